@@ -0,0 +1,500 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <numbers>
+#include <string>
+#include <vector>
+
+#include <glm/gtc/matrix_transform.hpp>
+#include "render.hpp"
+
+#ifndef JRENDER_MODEL_DIR
+#define JRENDER_MODEL_DIR "model"
+#endif
+
+using namespace jrender;
+
+// textured and lit like MyShader in main.cpp, with the transform owned by the shader
+using LightList = std::shared_ptr<const std::vector<PointLight>>;
+
+class LitShader : public Shader
+{
+public:
+    // without lights a single one at lightPos lights the model
+    LitShader(ModelPtr model, LightList lights = nullptr) : _model(model), _lights(std::move(lights)) {}
+
+    ShaderPtr clone() const override { return std::make_shared<LitShader>(*this); }
+
+    vec4 vs(vec3&& pos) override
+    {
+        vec4 gPos = _mvp * _instanceTransform * vec4(pos, 1.f);
+        if (_vertexID == 0) _diffuse = _model->diffuse();
+        _uv[_vertexID] = _model->texcoord(_model->texcoordIndex(_primID * 3 + _vertexID));
+        _norm[_vertexID] =
+            _mvp * _instanceTransform * vec4(_model->normal(_model->normalIndex(_primID * 3 + _vertexID)), 1.0);
+        _pos[_vertexID] = vec3(gPos);
+        return gPos;
+    }
+
+    bool fs(const vec3& bar, vec4& fragColor) override
+    {
+        Surface s;
+        surface(bar, s);
+        vec3 light{ 0.1f };
+        if (!_lights) {
+            constexpr vec3 lightPos{ 0, 1, 5 };
+            light += std::max(glm::dot(s.normal, glm::normalize(lightPos - s.position)), 0.0f);
+        }
+        else {
+            for (const auto& l : *_lights) {
+                light += l.lambert(s.position, s.normal);
+            }
+        }
+        fragColor = vec4(light * vec3(s.albedo), 1.0);
+        return false;
+    }
+
+    bool surface(const vec3& bar, Surface& out) override
+    {
+        vec2 uv = _uv * bar;
+        out.albedo = vec4(vec3(sample2D(*_diffuse, uv)), 1.0);
+        out.normal = glm::normalize(_norm * bar);
+        out.position = _pos * bar;
+        return false;
+    }
+
+    glm::mat4 _mvp{ 1.f };
+    glm::mat3x2 _uv;
+    glm::mat3 _norm;
+    glm::mat3 _pos;
+    ImagePtr _diffuse;
+    ModelPtr _model;
+    LightList _lights;
+};
+
+// per primitive flat color, for the synthetic meshes that carry positions only
+class FlatShader : public Shader
+{
+public:
+    ShaderPtr clone() const override { return std::make_shared<FlatShader>(*this); }
+
+    vec4 vs(vec3&& pos) override
+    {
+        if (_vertexID == 0) {
+            uint32_t h = _primID * 2654435761u;
+            _color = vec4((h & 0xff) / 255.f, ((h >> 8) & 0xff) / 255.f, ((h >> 16) & 0xff) / 255.f, 1.f);
+        }
+        return _mvp * vec4(pos, 1.f);
+    }
+
+    bool fs(const vec3&, vec4& fragColor) override
+    {
+        fragColor = _color;
+        return false;
+    }
+
+    glm::mat4 _mvp{ 1.f };
+    vec4 _color;
+};
+
+struct Scene
+{
+    std::string name;
+    ModelPtr model;
+    std::shared_ptr<Shader> shader;
+    std::function<glm::mat4(int frame, int frameCount, float aspect)> camera;  // sets and returns the shader transform
+    InstanceBuffer instances{};                                                // drawn instanced when set
+    ModelPtr occluder{};                         // drawn first and rasterized into the occlusion buffer
+    std::shared_ptr<FlatShader> occluderShader{};  // its _mvp is also the occluder's transform
+};
+
+// n x n grid of quads covering the view, two triangles each
+ModelPtr makeGrid(int n, float z)
+{
+    std::vector<vec3> vertices;
+    std::vector<int> indices;
+    for (int y = 0; y <= n; y++) {
+        for (int x = 0; x <= n; x++) {
+            vertices.emplace_back(x * 2.f / n - 1.f, y * 2.f / n - 1.f, z);
+        }
+    }
+    for (int y = 0; y < n; y++) {
+        for (int x = 0; x < n; x++) {
+            int i = y * (n + 1) + x;
+            indices.insert(indices.end(), { i, i + 1, i + n + 2, i, i + n + 2, i + n + 1 });
+        }
+    }
+    auto model = std::make_shared<Model>();
+    model->setVertices(std::move(vertices));
+    model->setIndices(std::move(indices));
+    return model;
+}
+
+// full screen quads stacked back to front so every layer passes the depth test
+ModelPtr makeLayers(int layers)
+{
+    std::vector<vec3> vertices;
+    std::vector<int> indices;
+    for (int l = 0; l < layers; l++) {
+        float z = 0.9f - 1.8f * l / layers;
+        int i = vertices.size();
+        vertices.insert(vertices.end(), { { -1, -1, z }, { 1, -1, z }, { 1, 1, z }, { -1, 1, z } });
+        indices.insert(indices.end(), { i, i + 1, i + 2, i, i + 2, i + 3 });
+    }
+    auto model = std::make_shared<Model>();
+    model->setVertices(std::move(vertices));
+    model->setIndices(std::move(indices));
+    return model;
+}
+
+// four walls from the origin along the x and z axes, both windings so they show from either side. long thin
+// triangles make the raster depth, interpolated linearly in screen space, drift from the occlusion buffer's
+ModelPtr makeCrossWalls(float length, float bottom, float top)
+{
+    std::vector<vec3> vertices;
+    std::vector<int> indices;
+    for (vec3 dir : { vec3(1, 0, 0), vec3(0, 0, 1), vec3(-1, 0, 0), vec3(0, 0, -1) }) {
+        int i = vertices.size();
+        vec3 end = dir * length;
+        vertices.insert(vertices.end(),
+                        { { 0, bottom, 0 }, end + vec3(0, bottom, 0), end + vec3(0, top, 0), { 0, top, 0 } });
+        indices.insert(indices.end(), { i, i + 1, i + 2, i, i + 2, i + 3, i, i + 2, i + 1, i, i + 3, i + 2 });
+    }
+    auto model = std::make_shared<Model>();
+    model->setVertices(std::move(vertices));
+    model->setIndices(std::move(indices));
+    return model;
+}
+
+// count lights spread over a grid in front of the crowd, in the clip space LitShader lights in
+std::vector<PointLight> makeLights(int count)
+{
+    if (!count) return { { vec3(0, 1, 5) } };  // LitShader's own light
+    std::vector<PointLight> lights;
+    int side = std::ceil(std::sqrt(count));
+    for (int i = 0; i < count; i++) {
+        vec2 cell = (vec2(i % side, i / side) + 0.5f) / (float)side * 2.f - 1.f;
+        uint32_t h = i * 2654435761u;
+        vec3 color = vec3((h & 0xff) / 255.f, ((h >> 8) & 0xff) / 255.f, ((h >> 16) & 0xff) / 255.f);
+        lights.push_back({ vec3(cell * 7.f, 6.f), color, 4.f });
+    }
+    return lights;
+}
+
+std::vector<Scene> makeScenes(const std::string& modelPath, const LightList& lights)
+{
+    std::vector<Scene> scenes;
+
+    auto diablo = std::make_shared<Model>();
+    diablo->loadModel(modelPath);
+    diablo->waitTextures();
+    // one full turntable revolution over the run, distance away from the model
+    auto turntable = [](std::shared_ptr<LitShader> lit, float distance) {
+        return [lit, distance](int frame, int frameCount, float aspect) {
+            float angle = 2.f * std::numbers::pi_v<float> * frame / frameCount;
+            glm::mat4 modelMat = glm::rotate(glm::mat4(1.f), angle, vec3(0, 1, 0));
+            glm::mat4 view = glm::translate(glm::mat4(1.f), vec3(0, 0, -distance));
+            glm::mat4 proj = glm::perspective(glm::radians(45.f), aspect, 0.1f, 100.f);
+            return lit->_mvp = proj * view * modelMat;
+        };
+    };
+    auto lit = std::make_shared<LitShader>(diablo, lights);
+    scenes.push_back({ "diablo3_pose", diablo, lit, turntable(lit, 2.f) });
+
+    // 8 x 8 copies on the ground plane, the turntable swings the outer ones in and out of view
+    auto crowd = std::make_shared<std::vector<glm::mat4>>();
+    for (int z = 0; z < 8; z++) {
+        for (int x = 0; x < 8; x++) {
+            glm::mat4 t = glm::translate(glm::mat4(1.f), vec3(x - 3.5f, 0.f, z - 3.5f) * 1.5f);
+            crowd->push_back(glm::scale(t, vec3(0.6f)));
+        }
+    }
+    auto crowdLit = std::make_shared<LitShader>(diablo, lights);
+    scenes.push_back({ "diablo3_crowd", diablo, crowdLit, turntable(crowdLit, 8.f), crowd });
+
+    // the same crowd split into quarters by walls, the ones behind are rejected by the occlusion buffer
+    auto occludedLit = std::make_shared<LitShader>(diablo, lights);
+    auto wallShader = std::make_shared<FlatShader>();
+    auto occludedCamera = [wallShader, camera = turntable(occludedLit, 8.f)](int frame, int frameCount, float aspect) {
+        return wallShader->_mvp = camera(frame, frameCount, aspect);
+    };
+    scenes.push_back({ "diablo3_occluded", diablo, occludedLit, occludedCamera, crowd, makeCrossWalls(6.f, -0.7f, 0.8f),
+                       wallShader });
+
+    auto flat = std::make_shared<FlatShader>();
+    auto identity = [flat](int, int, float) { return flat->_mvp = glm::mat4(1.f); };
+    scenes.push_back({ "tiny_triangles", makeGrid(256, 0.f), flat, identity });
+    scenes.push_back({ "huge_triangles", makeGrid(1, 0.f), flat, identity });
+    scenes.push_back({ "overdraw_x16", makeLayers(16), flat, identity });
+    return scenes;
+}
+
+double percentile(const std::vector<double>& sorted, double p)
+{
+    size_t i = std::min(sorted.size() - 1, (size_t)(p / 100.0 * sorted.size()));
+    return sorted[i];
+}
+
+std::vector<int> parseSizes(const char* arg)
+{
+    std::vector<int> sizes;
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        sizes.push_back(std::stoi(item));
+    }
+    return sizes;
+}
+
+std::string statsJson(const PipelineStats& s)
+{
+    return std::format("{{\"vertices_shaded\": {}, \"draws_culled\": {}, \"instances_culled\": {}, "
+                       "\"clusters_culled\": {}, \"draws_occluded\": {}, \"clusters_occluded\": {}, "
+                       "\"meshlet_cull_ratio\": {:.3f}, \"cluster_sorts\": {}, \"primitives_submitted\": {}, "
+                       "\"primitives_clipped\": {}, \"primitives_culled\": {}, \"pixels_covered\": {}, "
+                       "\"depth_passed\": {}, \"depth_failed\": {}, \"fragments_shaded\": {}, "
+                       "\"fragments_discarded\": {}, \"pixels_written\": {}, \"lights_shaded\": {}, "
+                       "\"tiles_redrawn\": {}, \"blocks_accepted\": {}, \"blocks_rejected\": {}, "
+                       "\"vertex_ns\": {}, \"setup_ns\": {}, \"raster_ns\": {}, \"fragment_ns\": {}}}",
+                       s.verticesShaded, s.drawsCulled, s.instancesCulled, s.clustersCulled, s.drawsOccluded,
+                       s.clustersOccluded, s.meshletsTested ? (double)s.meshletsCulled / s.meshletsTested : 0.0,
+                       s.clusterSorts, s.primitivesSubmitted, s.primitivesClipped, s.primitivesCulled,
+                       s.pixelsCovered, s.depthTestsPassed, s.depthTestsFailed, s.fragmentsShaded,
+                       s.fragmentsDiscarded, s.pixelsWritten, s.lightsShaded, s.tilesRedrawn, s.blocksAccepted,
+                       s.blocksRejected, s.vertexNs, s.setupNs, s.rasterNs, s.fragmentNs);
+}
+
+// usage: jrender_bench [--frames N] [--warmup N] [--sizes 256,512] [--model file.obj] [--out result.json]
+//                      [--stats 1] [--heatmap prefix] [--threads N] [--pipelined 1] [--replay 1]
+//                      [--occlusion 0] [--prepass 1] [--visibility 1] [--deferred 1] [--lights N]
+//                      [--front-to-back 1] [--incremental 1] [--budget ms]
+//                      [--msaa 2|4|8] [--vrs 1x2|2x2|4x4|auto]
+// with --stats the pipeline counters of the last frame are added to each result, timings then include counting.
+// --pipelined overlaps every frame's front end with the previous frame's raster, frame times are then the
+// intervals between submissions and the last frame includes draining the pipeline. --replay records each scene
+// into a command buffer once and replays it every frame. --occlusion 0 draws the occluded scene without its
+// occlusion buffer. --prepass 1 draws every frame twice, depth only and then shading at equal depth.
+// --visibility 1 rasterizes triangle ids and shades them in a resolve pass. --deferred 1 rasterizes a G-buffer
+// and lights it in a tiled pass. --lights N lights the diablo scenes with N point lights instead of one.
+// --front-to-back 1 draws instances and clusters nearest first. --incremental 1 keeps every frame and redraws only
+// the tiles whose draws changed since the previous one. --budget scales the resolution of each scene to hold that
+// frame time and scales frames below full size back up, each result then reports its mean scale. --msaa shades
+// once per pixel with the given samples of coverage and depth and resolves them every frame. --vrs shades every
+// draw at a coarse rate, auto picks the rate of each tile from the luminance of the previous frame.
+// --heatmap writes the last frame of every run with its overdraw heatmaps to <prefix>_<scene>_<size>_*.png
+int main(int argc, char** argv)
+{
+    int frameCount = 30;
+    int warmup = 3;
+    std::vector<int> sizes{ 256, 512, 1024 };
+    std::string modelPath = JRENDER_MODEL_DIR "/diablo3_pose/diablo3_pose.obj";
+    std::string outPath;
+    bool stats = false;
+    bool pipelined = false;
+    bool replay = false;
+    bool occlusion = true;
+    bool prepass = false;
+    bool visibility = false;
+    bool deferred = false;
+    int lightCount = 0;
+    bool frontToBack = false;
+    bool incremental = false;
+    double budget = 0;
+    int msaa = 1;
+    std::string vrs = "1x1";
+    std::string heatmapPrefix;
+    ThreadPool::Config poolConfig;
+
+    for (int i = 1; i < argc; i += 2) {
+        if (i + 1 == argc) {
+            std::fprintf(stderr, "unknown or incomplete option %s\n", argv[i]);
+            return 1;
+        }
+        if (!std::strcmp(argv[i], "--frames")) frameCount = std::max(1, std::atoi(argv[i + 1]));
+        else if (!std::strcmp(argv[i], "--warmup")) warmup = std::max(0, std::atoi(argv[i + 1]));
+        else if (!std::strcmp(argv[i], "--sizes")) sizes = parseSizes(argv[i + 1]);
+        else if (!std::strcmp(argv[i], "--model")) modelPath = argv[i + 1];
+        else if (!std::strcmp(argv[i], "--out")) outPath = argv[i + 1];
+        else if (!std::strcmp(argv[i], "--stats")) stats = std::atoi(argv[i + 1]) != 0;
+        else if (!std::strcmp(argv[i], "--heatmap")) heatmapPrefix = argv[i + 1];
+        else if (!std::strcmp(argv[i], "--pipelined")) pipelined = std::atoi(argv[i + 1]) != 0;
+        else if (!std::strcmp(argv[i], "--replay")) replay = std::atoi(argv[i + 1]) != 0;
+        else if (!std::strcmp(argv[i], "--occlusion")) occlusion = std::atoi(argv[i + 1]) != 0;
+        else if (!std::strcmp(argv[i], "--prepass")) prepass = std::atoi(argv[i + 1]) != 0;
+        else if (!std::strcmp(argv[i], "--visibility")) visibility = std::atoi(argv[i + 1]) != 0;
+        else if (!std::strcmp(argv[i], "--deferred")) deferred = std::atoi(argv[i + 1]) != 0;
+        else if (!std::strcmp(argv[i], "--lights")) lightCount = std::max(0, std::atoi(argv[i + 1]));
+        else if (!std::strcmp(argv[i], "--front-to-back")) frontToBack = std::atoi(argv[i + 1]) != 0;
+        else if (!std::strcmp(argv[i], "--incremental")) incremental = std::atoi(argv[i + 1]) != 0;
+        else if (!std::strcmp(argv[i], "--budget")) budget = std::max(0.0, std::atof(argv[i + 1]));
+        else if (!std::strcmp(argv[i], "--msaa")) msaa = std::max(1, std::atoi(argv[i + 1]));
+        else if (!std::strcmp(argv[i], "--vrs")) vrs = argv[i + 1];
+        else if (!std::strcmp(argv[i], "--threads")) poolConfig.threads = std::max(0, std::atoi(argv[i + 1]));
+        else {
+            std::fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    const std::pair<const char*, ShadingRate> rates[] = { { "1x1", ShadingRate::Rate1x1 },
+                                                          { "1x2", ShadingRate::Rate1x2 },
+                                                          { "2x2", ShadingRate::Rate2x2 },
+                                                          { "4x4", ShadingRate::Rate4x4 },
+                                                          { "auto", ShadingRate::Rate1x1 } };
+    auto rate = std::find_if(std::begin(rates), std::end(rates), [&](const auto& r) { return vrs == r.first; });
+    if (rate == std::end(rates)) {
+        std::fprintf(stderr, "unknown shading rate %s\n", vrs.c_str());
+        return 1;
+    }
+    const bool adaptiveRate = vrs == "auto";
+    if (prepass && visibility) {
+        std::fprintf(stderr, "--prepass and --visibility exclude each other\n");
+        return 1;
+    }
+
+    // before the scenes start loading textures on the pool
+    ThreadPool::configure(poolConfig);
+    auto lights = std::make_shared<const std::vector<PointLight>>(makeLights(lightCount));
+    std::vector<Scene> scenes = makeScenes(modelPath, lightCount ? lights : nullptr);
+
+    std::string json = std::format("{{\n  \"frames\": {},\n  \"warmup\": {},\n  \"threads\": {},\n"
+                                   "  \"pipelined\": {},\n  \"prepass\": {},\n  \"visibility\": {},\n"
+                                   "  \"deferred\": {},\n  \"lights\": {},\n  \"front_to_back\": {},\n"
+                                   "  \"incremental\": {},\n  \"budget_ms\": {},\n  \"msaa\": {},\n"
+                                   "  \"vrs\": \"{}\",\n"
+                                   "  \"results\": [",
+                                   frameCount, warmup, ThreadPool::global().threadCount() + 1, pipelined, prepass,
+                                   visibility, deferred, lights->size(), frontToBack, incremental,
+                                   budget, msaa, vrs);
+    bool first = true;
+    for (int size : sizes) {
+        ImagePtr frame = std::make_shared<Image>(size, size, Format::BGRA);
+        frame->setFlipVertical(true);  // same layout as main presents
+        Image present(size, size, Format::BGRA);
+        present.setFlipVertical(true);
+        for (auto& scene : scenes) {
+            Render render(frame, scene.model, scene.shader);
+            render.setViewport(0, 0, size, size);
+            render.setStatsEnabled(stats);
+            render.setHeatmapEnabled(!heatmapPrefix.empty());
+            render.setPipelined(pipelined);
+            render.setDepthPass(visibility ? DepthPass::Visibility : DepthPass::Shade);
+            render.setDeferred(deferred);
+            render.setFrontToBack(frontToBack);
+            render.setIncremental(incremental);
+            render.setSamples(msaa);
+            render.setShadingRate(rate->second);
+            render.setLights(*lights);
+            render.setAmbient(vec3(0.1f));
+
+            render.setInstanceTransforms(scene.instances);
+            std::shared_ptr<OcclusionBuffer> occlusionBuffer;
+            if (scene.occluder && occlusion) occlusionBuffer = std::make_shared<OcclusionBuffer>();
+            render.setOcclusionBuffer(occlusionBuffer);
+
+            // render and command buffer share the draw calls
+            auto submit = [&scene](auto& target) {
+                if (scene.occluder) {
+                    target.setModel(scene.occluder);
+                    target.setShader(scene.occluderShader);
+                    target.drawIndex(PrimitiveType::Triangle, 0, scene.occluder->faces() * 3);
+                    target.setModel(scene.model);
+                    target.setShader(scene.shader);
+                }
+                if (scene.instances) {
+                    target.drawIndexInstanced(PrimitiveType::Triangle, 0, scene.model->faces() * 3,
+                                              scene.instances->size());
+                }
+                else {
+                    target.drawIndex(PrimitiveType::Triangle, 0, scene.model->faces() * 3);
+                }
+            };
+            CommandBuffer commands;
+            commands.setModel(scene.model);
+            commands.setShader(scene.shader);
+            submit(commands);
+
+            std::vector<double> times;
+            ResolutionScaler scaler(size, size, budget);
+            double scaleSum = 0;
+            double pixels = 0;  // rendered in the timed frames, at the resolution each was drawn at
+            for (int i = -warmup; i < frameCount; i++) {
+                JRENDER_TRACE_SCOPE("frame");
+                render.setViewProj(scene.camera(std::max(i, 0), frameCount, 1.f));
+                if (occlusionBuffer) {
+                    occlusionBuffer->clear();
+                    occlusionBuffer->addOccluder(*scene.occluder, scene.occluderShader->_mvp);
+                }
+                if (i == 0) render.finish();  // keep warmup out of the timed frames
+                auto start = std::chrono::steady_clock::now();
+                render.clear();
+                for (int pass = prepass ? 0 : 1; pass < 2; pass++) {
+                    if (prepass) render.setDepthPass(pass ? DepthPass::DepthEqual : DepthPass::DepthOnly);
+                    if (replay) {
+                        render.execute(commands);
+                    }
+                    else {
+                        submit(render);
+                    }
+                }
+                if (incremental) render.endFrame();
+                if (msaa > 1) render.resolveSamples();
+                if (visibility) render.resolveVisibility();
+                if (deferred) render.resolveDeferred();
+                if (adaptiveRate) render.adaptShadingRates();
+                if (frame->width() != size) {
+                    render.finish();
+                    frame->scaleBilinear(present);
+                }
+                if (i == frameCount - 1) render.finish();
+                std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+                if (i >= 0) {
+                    times.push_back(elapsed.count());
+                    scaleSum += (double)frame->width() / size;
+                    pixels += (double)frame->width() * frame->height();
+                }
+                if (budget > 0 && scaler.update(elapsed.count())) {
+                    render.setResolution(scaler.width(), scaler.height());
+                    render.setViewport(0, 0, scaler.width(), scaler.height());
+                }
+            }
+
+            if (!heatmapPrefix.empty()) render.writeHeatmaps(std::format("{}_{}_{}", heatmapPrefix, scene.name, size));
+            render.setResolution(size, size);  // the next scene starts at full size
+
+            size_t triangles = scene.model->faces() * (scene.instances ? scene.instances->size() : 1)
+                               + (scene.occluder ? scene.occluder->faces() : 0);
+            double total = 0;
+            for (double t : times) {
+                total += t;
+            }
+            std::sort(times.begin(), times.end());
+            double seconds = total / 1000.0;
+
+            json += std::format("{}\n    {{\"scene\": \"{}\", \"width\": {}, \"height\": {}, \"triangles\": {}, ",
+                                first ? "" : ",", scene.name, size, size, triangles);
+            json += std::format("\"ms_mean\": {:.3f}, \"ms_min\": {:.3f}, \"ms_p50\": {:.3f}, \"ms_p90\": {:.3f}, "
+                                "\"ms_p99\": {:.3f}, \"ms_max\": {:.3f}, ",
+                                total / times.size(), times.front(), percentile(times, 50), percentile(times, 90),
+                                percentile(times, 99), times.back());
+            json += std::format("\"triangles_per_s\": {:.0f}, \"pixels_per_s\": {:.0f}",
+                                (double)triangles * times.size() / seconds,
+                                pixels / seconds);
+            if (budget > 0) json += std::format(", \"scale_mean\": {:.3f}", scaleSum / times.size());
+            json += stats ? std::format(", \"stats\": {}}}", statsJson(render.stats())) : std::string("}");
+            first = false;
+            std::fprintf(stderr, "%-16s %5dx%-5d p50 %8.3f ms\n", scene.name.c_str(), size, size,
+                         percentile(times, 50));
+        }
+    }
+    json += "\n  ]\n}\n";
+
+    if (outPath.empty()) {
+        std::fputs(json.c_str(), stdout);
+    }
+    else {
+        std::ofstream(outPath) << json;
+    }
+    return 0;
+}
@@ -16,6 +16,8 @@ public:
     ColorShader(jrender::ModelPtr model) : _model(model) {}
     ~ColorShader() override {}
 
+    jrender::ShaderPtr clone() const override { return std::make_shared<ColorShader>(*this); }
+
     virtual glm::vec4 vs(glm::vec3&& pos) override { return glm::vec4(pos, 1.0); }
 
     bool fs(const glm::vec3& bar, glm::vec4& fragColor) override
@@ -37,6 +39,8 @@ public:
     TextureShader(jrender::ModelPtr model) : _model(model) {}
     ~TextureShader() override {}
 
+    jrender::ShaderPtr clone() const override { return std::make_shared<TextureShader>(*this); }
+
     virtual glm::vec4 vs(glm::vec3&& pos) override
     {
         _pos[_vertexID] = std::move(pos);
@@ -69,9 +73,12 @@ public:
     MyShader(jrender::ModelPtr model) : _model(model) {}
     ~MyShader() override {}
 
+    jrender::ShaderPtr clone() const override { return std::make_shared<MyShader>(*this); }
+
     virtual glm::vec4 vs(glm::vec3&& pos) override
     {
         glm::vec4 gPos = mvp * glm::vec4(pos, 1.f);
+        if (_vertexID == 0) _diffuse = _model->diffuse();  // pinned for the primitive
         _uv[_vertexID] = _model->texcoord(_model->texcoordIndex(_primID * 3 + _vertexID));
         _norm[_vertexID] =
           mvp * glm::vec4(_model->normal(_model->normalIndex(_primID * PrimVertexCount(_primType) + _vertexID)), 1.0);
@@ -99,7 +106,7 @@ public:
         float diff = std::max(glm::dot(norm, lightDir), 0.0f);
         vec3 diffuseColor = diff * lightColor;
 
-        fragColor = vec4((ambientColor + diffuseColor) * vec3(sample2D(_model->diffuse(), uv)), 1.0);
+        fragColor = vec4((ambientColor + diffuseColor) * vec3(sample2D(*_diffuse, uv)), 1.0);
 
         return false;  // not discarded
     }
@@ -107,6 +114,7 @@ public:
     glm::mat3x2 _uv;
     glm::mat3 _norm;
     glm::mat3 _pos;
+    jrender::ImagePtr _diffuse;
 
     jrender::ModelPtr _model;
 };
@@ -137,8 +145,11 @@ int main()
     ImagePtr frame = std::make_shared<Image>(screenWidth, screenHeight, Format::BGRA);
     frame->setFlipVertical(true);
 
+    // the window's pixels, the frame may render smaller and is scaled up into it
+    Image present(screenWidth, screenHeight, Format::BGRA);
+    present.setFlipVertical(true);
     XImage* xImage = XCreateImage(display, DefaultVisual(display, 0), DefaultDepth(display, 0), ZPixmap, 0,
-                                  frame->data(), screenWidth, screenHeight, 32, 0);
+                                  present.data(), screenWidth, screenHeight, 32, 0);
 
     // color
     ModelPtr vertices = std::make_shared<Model>();
@@ -176,12 +187,16 @@ int main()
 
     render.setShader(shaderD);
     render.setModel(model);
+    render.setIncremental(true);
+
+    // lowers the resolution while frames take longer than 30 fps allow
+    ResolutionScaler scaler(screenWidth, screenHeight, 1000.0 / 30);
 
     // 事件循环
     auto startT = std::chrono::high_resolution_clock::now();
     auto lastT = startT;
     while (true) {
-    render.clear();
+    JRENDER_TRACE_SCOPE("frame");
 
     glm::mat4 modelMat(1.f);
     glm::mat4 view(1.f);
@@ -192,6 +207,12 @@ int main()
         std::cout << std::format("frame:{}\n", std::floor(1.0 / elapsed.count()));
     lastT = now;
 
+    if (scaler.update(elapsed.count() * 1000)) {
+        render.setResolution(scaler.width(), scaler.height());
+        render.setViewport(scaler.width() / 8, scaler.height() / 8, scaler.width() * 3 / 4, scaler.height() * 3 / 4);
+    }
+    render.clear();
+
     elapsed = now - startT;
         modelMat = glm::rotate(modelMat, (float)elapsed.count(), glm::vec3(0, 1, 0));
         view = glm::translate(view, glm::vec3(0, 0, -2));
@@ -201,8 +222,38 @@ int main()
 
     // 将图像绘制到窗口
     render.drawIndex(PrimitiveType::Triangle, 0, model->faces() * 3);
-    std::copy(frame->data(), frame->data() + frame->size(), xImage->data);
-    XPutImage(display, window, gc, xImage, 0, 0, 0, 0, screenWidth, screenHeight);
+    std::vector<Rect> damage = render.endFrame();
+
+    // at full size only the damaged rectangles changed, the frame stores them bottom row first
+    if (frame->width() != screenWidth || frame->height() != screenHeight) {
+        JRENDER_TRACE_SCOPE("present upscale");
+        frame->scaleBilinear(present);
+        damage = { Rect{ 0, 0, screenWidth, screenHeight } };
+    }
+    else {
+        JRENDER_TRACE_SCOPE("present copy");
+        const int pitch = screenWidth * 4;
+        for (const Rect& r : damage) {
+            for (int y = screenHeight - r.y - r.height; y < screenHeight - r.y; y++) {
+                const char* row = frame->data() + y * pitch + r.x * 4;
+                std::copy(row, row + r.width * 4, present.data() + y * pitch + r.x * 4);
+            }
+        }
+    }
+    {
+        JRENDER_TRACE_SCOPE("XPutImage");
+        for (const Rect& r : damage) {
+            int y = screenHeight - r.y - r.height;
+            XPutImage(display, window, gc, xImage, r.x, y, r.x, y, r.width, r.height);
+        }
+    }
+
+    // any key writes the trace recorded so far when built with JRENDER_TRACE
+    while (XPending(display)) {
+        XEvent event;
+        XNextEvent(display, &event);
+        if (event.type == KeyPress) JRENDER_TRACE_DUMP("jrender_trace.json");
+    }
     }
 
     // 清理
@@ -2,15 +2,37 @@
 #include <fstream>
 #include <sstream>
 #include <vector>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <memory>
 #include <algorithm>
+#include <cmath>
+#include <condition_variable>
 #include <format>
+#include <functional>
+#include <limits>
+#include <future>
+#include <list>
+#include <mutex>
+#include <numeric>
+#include <string>
+#include <unordered_map>
 
 #include <glm/glm.hpp>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb/stb_image.h>
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb/stb_image_write.h>
+
+#include "thread_pool.hpp"
+#include "trace.hpp"
 
 namespace jrender {
 
@@ -18,7 +40,7 @@ using glm::vec2;
 using glm::vec3;
 using glm::vec4;
 
-enum class PrimitiveType { Point, Line, Triangle };
+enum class PrimitiveType : uint8_t { Point, Line, Triangle };
 enum class Format { GRAYSCALE = 1, RGB = 3, RGBA = 4, BGRA = 5 };
 
 struct Color
@@ -111,12 +133,22 @@ public:
 
     ~Image() {}
 
+    // the pixels are undefined afterwards, the allocation is kept up to the largest size the image had
+    void resize(int w, int h)
+    {
+        _width = w;
+        _height = h;
+        _pixels.resize(w * h * FormatSize(_format));
+    }
+
     void setFlipVertical(bool flip) { _flipVertical = flip; }
+    bool flipVertical() const { return _flipVertical; }
 
     void loadImage(const char* filePath)
     {
         int channels;
-        stbi_set_flip_vertically_on_load(_flipVertical);
+        // textures are decoded on pool threads, keep the flip state thread local
+        stbi_set_flip_vertically_on_load_thread(_flipVertical);
         u_int8_t* data = stbi_load(filePath, &_width, &_height, &channels, 0);
         if (data == nullptr) {
             std::printf("load %s failed!\n", filePath);
@@ -153,6 +185,21 @@ public:
         }
     }
 
+    // what setPixel stored
+    Color readPixel(int x, int y) const
+    {
+        y = _flipVertical ? (_height - 1 - y) : y;
+        const uint8_t* p = _pixels.data() + (y * _width + x) * FormatSize(_format);
+        switch (_format) {
+        case Format::BGRA:
+            return { p[2], p[1], p[0], p[3] };
+        case Format::RGBA:
+            return { p[0], p[1], p[2], p[3] };
+        default:
+            return {};
+        }
+    }
+
     Color pixel(int x, int y) const
     {
         if (!_pixels.size() || x < 0 || y < 0 || x >= _width || y >= _height) return {};
@@ -169,21 +216,402 @@ public:
     int width() const { return _width; }
     int height() const { return _height; }
     int size() const { return _pixels.size(); }
+    bool empty() const { return _pixels.empty(); }
 
     char* data() { return (char*)_pixels.data(); }
 
+    // writes a png, rows are stored as laid out in memory
+    bool write(const std::string& filePath) const
+    {
+        if (_pixels.empty()) return false;
+        if (_format != Format::BGRA) {
+            return stbi_write_png(filePath.c_str(), _width, _height, FormatSize(_format), _pixels.data(), 0);
+        }
+
+        std::vector<uint8_t> rgba(_pixels);
+        for (size_t i = 0; i < rgba.size(); i += 4) {
+            std::swap(rgba[i], rgba[i + 2]);
+        }
+        return stbi_write_png(filePath.c_str(), _width, _height, 4, rgba.data(), 0);
+    }
+
+    // next mip level, each texel is the box filtered average of a 2x2 block
+    Image downsample() const
+    {
+        Image ret(std::max(_width / 2, 1), std::max(_height / 2, 1), _format);
+        int pSize = FormatSize(_format);
+        for (int y = 0; y < ret._height; y++) {
+            int y0 = std::min(y * 2, _height - 1), y1 = std::min(y * 2 + 1, _height - 1);
+            for (int x = 0; x < ret._width; x++) {
+                int x0 = std::min(x * 2, _width - 1), x1 = std::min(x * 2 + 1, _width - 1);
+                for (int c = 0; c < pSize; c++) {
+                    int sum = _pixels[(y0 * _width + x0) * pSize + c] + _pixels[(y0 * _width + x1) * pSize + c]
+                              + _pixels[(y1 * _width + x0) * pSize + c] + _pixels[(y1 * _width + x1) * pSize + c];
+                    ret._pixels[(y * ret._width + x) * pSize + c] = (sum + 2) / 4;
+                }
+            }
+        }
+        return ret;
+    }
+
     void clear() { std::fill(_pixels.begin(), _pixels.end(), 0); }
 
+    // bilinear resize into dst of the same format with pixel centers lined up. rows map as laid out in memory, so
+    // both images should share the flip. steps are 16.16 fixed point, rows run in parallel
+    void scaleBilinear(Image& dst) const
+    {
+        const int pSize = FormatSize(_format);
+        const int64_t stepX = ((int64_t)_width << 16) / dst._width, stepY = ((int64_t)_height << 16) / dst._height;
+        auto source = [](int i, int64_t step, int size) {
+            return (int)std::clamp<int64_t>(i * step + step / 2 - 0x8000, 0, (int64_t)(size - 1) << 16);
+        };
+        std::vector<int> xs(dst._width);
+        for (int x = 0; x < dst._width; x++) {
+            xs[x] = source(x, stepX, _width);
+        }
+
+        ThreadPool::global().parallelFor(0, dst._height, 16, [&](int y0, int y1) {
+            for (int y = y0; y < y1; y++) {
+                int sy = source(y, stepY, _height), r0 = sy >> 16, fy = (sy >> 8) & 0xff;
+                const uint8_t* row0 = _pixels.data() + r0 * _width * pSize;
+                const uint8_t* row1 = _pixels.data() + std::min(r0 + 1, _height - 1) * _width * pSize;
+                uint8_t* out = dst._pixels.data() + y * dst._width * pSize;
+                for (int x = 0; x < dst._width; x++) {
+                    int c0 = (xs[x] >> 16) * pSize, c1 = std::min((xs[x] >> 16) + 1, _width - 1) * pSize;
+                    int fx = (xs[x] >> 8) & 0xff;
+                    for (int c = 0; c < pSize; c++) {
+                        int top = row0[c0 + c] * (256 - fx) + row0[c1 + c] * fx;
+                        int bottom = row1[c0 + c] * (256 - fx) + row1[c1 + c] * fx;
+                        out[x * pSize + c] = (top * (256 - fy) + bottom * fy + 0x8000) >> 16;
+                    }
+                }
+            }
+        });
+    }
+
+    // zeroes a rectangle given in setPixel coordinates
+    void clear(int x, int y, int w, int h)
+    {
+        int pSize = FormatSize(_format);
+        for (int row = y; row < y + h; row++) {
+            int r = _flipVertical ? (_height - 1 - row) : row;
+            std::fill_n(_pixels.begin() + (r * _width + x) * pSize, w * pSize, 0);
+        }
+    }
+
 private:
     bool _flipVertical{ false };
-    Format _format;
-    int _width;
-    int _height;
+    Format _format{ Format::RGBA };
+    int _width{ 0 };
+    int _height{ 0 };
 
     std::vector<uint8_t> _pixels;
 };
 using ImagePtr = std::shared_ptr<Image>;
 
+// shares decoded textures between models by file path and mip level. once the resident size exceeds the budget
+// the least recently used textures are dropped, images still referenced elsewhere stay alive and counted until
+// released
+class TextureCache
+{
+public:
+    // when a texture was last used, holders of the image refresh it on hits without taking the cache's lock
+    struct Usage
+    {
+        std::atomic<int64_t> lastUse{ 0 };
+
+        void touch()
+        {
+            // one store per millisecond at most, so hits from many threads don't keep moving its cache line
+            constexpr int64_t Interval = 1000000;
+            int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              std::chrono::steady_clock::now().time_since_epoch())
+                              .count();
+            if (now - lastUse.load(std::memory_order_relaxed) > Interval) {
+                lastUse.store(now, std::memory_order_relaxed);
+            }
+        }
+    };
+
+    static TextureCache& global()
+    {
+        static TextureCache cache;
+        return cache;
+    }
+
+    // budget in bytes, 0 means unlimited
+    void setBudget(size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _budget = bytes;
+        evict(Key{});
+    }
+
+    size_t budget() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _budget;
+    }
+
+    // includes evicted images that are still referenced
+    size_t residentBytes() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _residentBytes + evictedBytes();
+    }
+
+    size_t residentCount() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _lru.size();
+    }
+
+    // starts decoding on the global thread pool unless the texture is resident or already loading
+    std::shared_future<void> prefetch(const std::string& path, int level = 0)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto [it, inserted] = _entries.try_emplace(Key{ path, level });
+        if (inserted) {
+            auto loading = startLoading(it->second);
+            ThreadPool::global().submit([this, loading, path, level] { runLoad(*loading, path, level); });
+        }
+        return it->second.ready;
+    }
+
+    // returns the resident texture and decodes it on the calling thread on a miss or when its prefetch hasn't
+    // started yet. while another thread decodes it the caller blocks instead of running queued tasks: fs calls
+    // this from raster tasks, and the tasks it would pick up could share the shader clone of the one waiting.
+    // usage receives the recency stamp of the texture, evicted images still referenced are taken back as they are
+    ImagePtr acquire(const std::string& path, int level = 0, std::shared_ptr<Usage>* usage = nullptr)
+    {
+        const Key k{ path, level };
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true) {
+            auto [it, inserted] = _entries.try_emplace(k);
+            if (inserted && !reinstate(k, it->second)) startLoading(it->second);
+            if (!it->second.image) {
+                std::shared_ptr<Loading> loading = it->second.loading;
+                std::shared_future<void> ready = it->second.ready;
+                lock.unlock();
+                if (!runLoad(*loading, path, level)) ready.wait();
+                lock.lock();
+            }
+
+            // the entry may have been evicted again while the lock was released
+            it = _entries.find(k);
+            if (it != _entries.end() && it->second.image) {
+                it->second.usage->touch();
+                if (usage) *usage = it->second.usage;
+                return it->second.image;
+            }
+        }
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (auto it = _entries.begin(); it != _entries.end();) {
+            if (it->second.image) {
+                retire(it->first, it->second);
+                it = _entries.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+        _lru.clear();
+    }
+
+private:
+    struct Key
+    {
+        std::string path;
+        int level;
+
+        bool operator==(const Key&) const = default;
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const Key& k) const { return std::hash<std::string>()(k.path) ^ (size_t)k.level; }
+    };
+
+    // the first thread to claim a load decodes the texture, the others wait for done
+    struct Loading
+    {
+        std::atomic<bool> claimed{ false };
+        std::promise<void> done;
+    };
+
+    struct Entry
+    {
+        ImagePtr image;  // null while loading
+        std::shared_ptr<Loading> loading;
+        std::shared_future<void> ready;
+        size_t bytes{ 0 };
+        std::shared_ptr<Usage> usage;
+    };
+
+    // evicted while shaders or draws still held the image
+    struct Evicted
+    {
+        Key key;
+        std::weak_ptr<Image> image;
+        size_t bytes;
+        std::shared_ptr<Usage> usage;
+    };
+
+    std::shared_ptr<Loading> startLoading(Entry& e)
+    {
+        e.loading = std::make_shared<Loading>();
+        e.ready = e.loading->done.get_future().share();
+        return e.loading;
+    }
+
+    // false when another thread claimed the load first
+    bool runLoad(Loading& loading, const std::string& path, int level)
+    {
+        if (loading.claimed.exchange(true, std::memory_order_acq_rel)) return false;
+        try {
+            load(path, level);
+        }
+        catch (...) {
+            loading.done.set_exception(std::current_exception());
+            throw;
+        }
+        loading.done.set_value();
+        return true;
+    }
+
+    void load(const std::string& path, int level)
+    {
+        JRENDER_TRACE_SCOPE("TextureCache::load");
+        auto img = std::make_shared<Image>(path.c_str());
+        for (int i = 0; i < level && !img->empty() && (img->width() > 1 || img->height() > 1); i++) {
+            img = std::make_shared<Image>(img->downsample());
+        }
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        const Key k{ path, level };
+        Entry& e = _entries[k];
+        e.loading = {};
+        e.usage = std::make_shared<Usage>();
+        e.usage->touch();
+        insert(k, e, std::move(img));
+    }
+
+    void insert(const Key& k, Entry& e, ImagePtr img)
+    {
+        e.image = std::move(img);
+        e.bytes = e.image->size();
+        _residentBytes += e.bytes;
+        _lru.push_front(k);
+        evict(k);
+    }
+
+    // takes an evicted image that is still referenced back into the cache
+    bool reinstate(const Key& k, Entry& e)
+    {
+        auto it = std::find_if(_evicted.begin(), _evicted.end(), [&](const Evicted& ev) { return ev.key == k; });
+        if (it == _evicted.end()) return false;
+        ImagePtr img = it->image.lock();
+        e.usage = std::move(it->usage);
+        _evicted.erase(it);
+        if (!img) return false;
+        e.ready = readyFuture();
+        insert(k, e, std::move(img));
+        return true;
+    }
+
+    static std::shared_future<void> readyFuture()
+    {
+        std::promise<void> done;
+        done.set_value();
+        return done.get_future().share();
+    }
+
+    // true if the image outlives the entry
+    bool retire(const Key& k, Entry& e)
+    {
+        _residentBytes -= e.bytes;
+        if (e.image.use_count() == 1) return false;
+        _evicted.push_back({ k, e.image, e.bytes, e.usage });
+        return true;
+    }
+
+    size_t evictedBytes() const
+    {
+        size_t ret = 0;
+        for (const Evicted& ev : _evicted) {
+            if (!ev.image.expired()) ret += ev.bytes;
+        }
+        return ret;
+    }
+
+    // drop least recently used textures until the budget is met, never the one that was just touched
+    void evict(const Key& keep)
+    {
+        std::erase_if(_evicted, [](const Evicted& ev) { return ev.image.expired(); });
+        if (!_budget) return;
+        size_t held = evictedBytes();
+        if (_residentBytes + held <= _budget) return;
+
+        // hits only stamp their entry's usage, so order by it first
+        _lru.sort([this](const Key& a, const Key& b) {
+            return _entries.at(a).usage->lastUse.load(std::memory_order_relaxed)
+                   > _entries.at(b).usage->lastUse.load(std::memory_order_relaxed);
+        });
+        auto it = _lru.end();
+        while (_residentBytes + held > _budget && it != _lru.begin()) {
+            --it;
+            if (*it == keep) continue;
+            auto entry = _entries.find(*it);
+            if (retire(entry->first, entry->second)) held += entry->second.bytes;
+            _entries.erase(entry);
+            it = _lru.erase(it);
+        }
+    }
+
+    mutable std::mutex _mutex;
+    std::unordered_map<Key, Entry, KeyHash> _entries;
+    std::list<Key> _lru;  // most recently used first as of the last eviction
+    std::vector<Evicted> _evicted;
+    size_t _residentBytes{ 0 };  // of the entries alone
+    size_t _budget{ 0 };
+};
+
+// what fs hands the deferred path instead of a color. normal and position are in the space of the lights, a zero
+// normal leaves the pixel unlit
+struct Surface
+{
+    vec4 albedo{ 0.f };
+    vec3 normal{ 0.f };
+    vec3 position{ 0.f };
+};
+
+// the contribution falls to zero at radius, a radius of 0 never fades
+struct PointLight
+{
+    vec3 position;
+    vec3 color{ 1.f };
+    float radius{ 0.f };
+
+    float attenuation(float distance) const
+    {
+        if (radius <= 0) return 1.f;
+        float t = std::max(1.f - distance / radius, 0.f);
+        return t * t;
+    }
+
+    // diffuse term at a surface point, forward shaders using it light the same way the deferred pass does
+    vec3 lambert(const vec3& position, const vec3& normal) const
+    {
+        vec3 toLight = this->position - position;
+        float diff = std::max(glm::dot(normal, glm::normalize(toLight)), 0.0f);
+        return diff * color * attenuation(glm::length(toLight));
+    }
+};
+
 class Shader
 {
 public:
@@ -197,24 +625,153 @@ public:
     virtual vec4 vs(vec3&& pos) = 0;
     virtual bool fs(const vec3& bary, vec4& fragColor) = 0;
 
+    // fs of the deferred path, returns true to discard like fs. the default writes fs's color unlit
+    virtual bool surface(const vec3& bary, Surface& out) { return fs(bary, out.albedo); }
+
+    // a copy with the same uniforms. Render shades triangles on one copy per worker thread, shaders returning
+    // nullptr are run on the calling thread instead
+    virtual std::shared_ptr<Shader> clone() const { return nullptr; }
+
     PrimitiveType _primType;
     uint8_t _vertexID;
     uint32_t _primID;
+    uint32_t _instanceID{ 0 };
+    glm::mat4 _instanceTransform{ 1.f };  // from the render's instance buffer, identity without one
 };
 using ShaderPtr = std::shared_ptr<Shader>;
 
+struct AABB
+{
+    vec3 min{ std::numeric_limits<float>::max() };
+    vec3 max{ std::numeric_limits<float>::lowest() };
+
+    bool empty() const { return min.x > max.x; }
+    vec3 center() const { return (min + max) * 0.5f; }
+    vec3 extent() const { return max - min; }
+
+    void expand(const vec3& p)
+    {
+        min = glm::min(min, p);
+        max = glm::max(max, p);
+    }
+};
+
+struct BoundingSphere
+{
+    vec3 center{ 0.f };
+    float radius{ -1.f };
+
+    bool empty() const { return radius < 0; }
+};
+
+// up to Model::MeshletFaces faces close in position and orientation. the faces are listed in
+// Model::meshletFaces() and need not be consecutive in the model
+struct Meshlet
+{
+    uint32_t first;  // into Model::meshletFaces()
+    uint32_t count;
+    AABB bounds;
+    BoundingSphere sphere;
+    vec3 coneAxis;
+    float coneCos;  // every face normal is within acos(coneCos) of the axis, <= 0 when they spread too far
+
+    // true if eye (in model space) is behind every face, so the rasterizer would cull all of them. the faces lie
+    // in the sphere, the view rays to it stay within asin(r / d) of its center and have to be more than 90 degrees
+    // away from every normal. that only leaves room when the two angles add up to less than 90 degrees, an eye
+    // closer to the sphere never culls
+    bool backfacing(const vec3& eye) const
+    {
+        if (coneCos <= 0) return false;
+        vec3 v = sphere.center - eye;
+        float d2 = glm::dot(v, v), r = sphere.radius;
+        if (d2 <= r * r) return false;
+        float coneSin = std::sqrt(1 - coneCos * coneCos), tangent = std::sqrt(d2 - r * r);
+        if (coneCos * tangent <= coneSin * r) return false;
+        return glm::dot(v, coneAxis) > coneSin * tangent + coneCos * r;
+    }
+};
+
+// consecutive meshlets with their joint bounds, large models test these before their meshlets
+struct CullCluster
+{
+    int firstMeshlet;
+    int meshletCount;
+    AABB bounds;
+    BoundingSphere sphere;
+};
+
+// clip volume -w <= x, y, z <= w of a (model) view projection matrix as six normalized planes facing inwards
+struct Frustum
+{
+    vec4 planes[6];
+
+    explicit Frustum(const glm::mat4& m)
+    {
+        vec4 w{ m[0][3], m[1][3], m[2][3], m[3][3] };
+        for (int i = 0; i < 3; i++) {
+            vec4 row{ m[0][i], m[1][i], m[2][i], m[3][i] };
+            planes[i * 2] = w + row;
+            planes[i * 2 + 1] = w - row;
+        }
+        for (auto& p : planes) {
+            float len = glm::length(vec3(p));
+            if (len > 0) p /= len;
+        }
+    }
+
+    bool intersects(const BoundingSphere& sphere) const
+    {
+        for (const auto& p : planes) {
+            if (glm::dot(vec3(p), sphere.center) + p.w < -sphere.radius) return false;
+        }
+        return true;
+    }
+
+    // false only if the box is entirely outside one plane, boxes near the corners may pass
+    bool intersects(const AABB& box) const
+    {
+        for (const auto& p : planes) {
+            vec3 n(p);
+            vec3 corner = glm::mix(box.min, box.max, glm::greaterThanEqual(n, vec3(0.f)));
+            if (glm::dot(n, corner) + p.w < 0) return false;
+        }
+        return true;
+    }
+};
+
+enum class TextureSlot {
+    Normal,    // normal map texture
+    Diffuse,   // diffuse color texture
+    Specular,  // specular map texture
+    Count
+};
+
 class Model
 {
 public:
     Model() {}
     ~Model() {}
 
+    // textures live in the TextureCache. unless lazy loading is enabled they are prefetched on the thread pool
+    // while the geometry is parsed and loadModel returns without waiting for them, until a texture arrives its
+    // accessor returns a flat placeholder. lazy textures are decoded on first sample
     void loadModel(const std::string& filename)
     {
+        JRENDER_TRACE_SCOPE("Model::loadModel");
+        size_t dot = filename.find_last_of(".");
+        if (dot != std::string::npos) {
+            std::string baseName = filename.substr(0, dot);
+            setTexturePath(TextureSlot::Normal, std::format("{}_nm_tangent.tga", baseName));
+            setTexturePath(TextureSlot::Diffuse, std::format("{}_diffuse.tga", baseName));
+            setTexturePath(TextureSlot::Specular, std::format("{}_spec.tga", baseName));
+        }
+
         std::ifstream in;
         in.open(filename, std::ifstream::in);
         if (in.fail()) return;
         std::string line;
+        std::vector<Corner> corners;
+        std::vector<int> tris;
         while (!in.eof()) {
             std::getline(in, line);
             std::istringstream iss(line.c_str());
@@ -242,39 +799,211 @@ public:
                 _texCoords.push_back({ uv.x, 1 - uv.y });
             }
             else if (!line.compare(0, 2, "f ")) {
-                int f, t, n;
-                iss >> trash;
-                int cnt = 0;
-                while (iss >> f >> trash >> t >> trash >> n) {
-                    _vertIndices.push_back(--f);
-                    _texIndices.push_back(--t);
-                    _normIndices.push_back(--n);
-                    cnt++;
-                }
-                if (3 != cnt) {
-                    std::cerr << "Error: the obj file is supposed to be triangulated" << std::endl;
-                    return;
+                // corners are v, v/vt, v//vn or v/vt/vn, negative indices count back from the last element read
+                corners.clear();
+                const char* p = line.c_str() + 2;
+                while (true) {
+                    char* end;
+                    long v = std::strtol(p, &end, 10);
+                    if (end == p) break;
+                    p = end;
+                    long t = 0, n = 0;
+                    if (*p == '/') {
+                        t = std::strtol(++p, &end, 10);
+                        p = end;
+                        if (*p == '/') {
+                            n = std::strtol(++p, &end, 10);
+                            p = end;
+                        }
+                    }
+                    corners.push_back({ objIndex(v, _vertices.size()), objIndex(t, _texCoords.size()),
+                                        objIndex(n, _norms.size()) });
+                }
+                if (corners.size() < 3) {
+                    std::cerr << "Warning: skipping face with " << corners.size() << " vertices" << std::endl;
+                    continue;
+                }
+
+                triangulate(corners, tris);
+                for (int c : tris) {
+                    _vertIndices.push_back(corners[c].v);
+                    _texIndices.push_back(corners[c].t);
+                    _normIndices.push_back(corners[c].n);
                 }
             }
         }
+        computeBounds();
+        computeClusters();
+    }
 
-        size_t dot = filename.find_last_of(".");
-        if (dot == std::string::npos) return;
-        std::string baseName = filename.substr(0, dot);
+    void setTexturePath(TextureSlot slot, std::string path)
+    {
+        TextureRef& ref = _maps[(int)slot];
+        ref.path = std::move(path);
+        ref.ready = _lazyTextures ? std::shared_future<void>{}
+                                  : TextureCache::global().prefetch(ref.path, _textureLevel);
+        ref.arrived.store(!ref.ready.valid(), std::memory_order_release);
+        ref.resolved.store({}, std::memory_order_release);
+    }
+
+    // load textures on first sample instead of prefetching them in loadModel
+    void setLazyTextures(bool lazy) { _lazyTextures = lazy; }
+
+    // mip level kept resident for the model's textures, each level halves width and height
+    void setTextureLevel(int level)
+    {
+        _textureLevel = std::max(level, 0);
+        for (int i = 0; i < (int)TextureSlot::Count; i++) {
+            if (!_maps[i].path.empty()) setTexturePath((TextureSlot)i, _maps[i].path);
+        }
+    }
+
+    // becomes ready once the prefetched texture of the slot has been decoded (or failed to load)
+    std::shared_future<void> textureReady(TextureSlot slot) const { return _maps[(int)slot].ready; }
+
+    bool textureLoaded(TextureSlot slot) const
+    {
+        const auto& ready = _maps[(int)slot].ready;
+        return ready.valid() && ready.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+
+    void waitTextures() const
+    {
+        for (const auto& m : _maps) {
+            if (m.ready.valid()) m.ready.wait();
+        }
+    }
+
+    // positions and uvs of a quantized model are one per packed vertex and get packed again over their new range
+    void setVertices(std::vector<vec3>&& vertices)
+    {
+        _vertices = std::move(vertices);
+        computeBounds();
+        if (_quantized) {
+            _packed.resize(_vertices.size());
+            _quant.posMin = _bounds.min;
+            _quant.posScale = glm::max(_bounds.extent(), vec3(1e-20f)) / 65535.f;
+            for (size_t i = 0; i < _packed.size(); i++) {
+                std::copy_n(packVertex(_vertices[i], {}, {}).pos, 3, _packed[i].pos);
+            }
+            _vertices = {};
+        }
+        computeClusters();
+    }
+    // indices of a quantized model refer to its packed vertices
+    void setIndices(std::vector<int>&& indices)
+    {
+        _vertIndices = std::move(indices);
+        _indices16 = {};
+        computeClusters();
+    }
+    void setTexCoords(std::vector<vec2>&& texCoords)
+    {
+        _texCoords = std::move(texCoords);
+        if (!_quantized) return;
+        AABB uvBounds;
+        for (const vec2& uv : _texCoords) {
+            uvBounds.expand(vec3(uv, 0));
+        }
+        _quant.uvMin = _texCoords.empty() ? vec2(0) : vec2(uvBounds.min);
+        _quant.uvScale = _texCoords.empty() ? vec2(0) : glm::max(vec2(uvBounds.extent()), vec2(1e-20f)) / 65535.f;
+        for (size_t i = 0; i < _packed.size(); i++) {
+            vec2 uv = i < _texCoords.size() ? _texCoords[i] : vec2(0);
+            std::copy_n(packVertex({}, uv, {}).uv, 2, _packed[i].uv);
+        }
+        _texCoords = {};
+    }
 
-        _normalMap.loadImage(std::format("{}_nm_tangent.tga", baseName).c_str());
-        _diffuseMap.loadImage(std::format("{}_diffuse.tga", baseName).c_str());
-        _specularMap.loadImage(std::format("{}_spec.tga", baseName).c_str());
+    int faces() const { return (_quantized ? indexCount() : _vertIndices.size()) / 3; }
+
+    const AABB& bounds() const { return _bounds; }
+    const BoundingSphere& boundingSphere() const { return _sphere; }
+
+    // faces are grouped into meshlets at load: by normal direction into 8x8 octahedral cells, then along a morton
+    // curve through the bounds. the face order of the model stays as it is, shaders index attributes by _primID
+    static constexpr int MeshletFaces = 64;
+    const std::vector<Meshlet>& meshlets() const { return _meshlets; }
+    const std::vector<uint32_t>& meshletFaces() const { return _meshletFaces; }
+
+    // models over 2 * CullClusterFaces faces also group CullClusterFaces / MeshletFaces meshlets into a cluster,
+    // empty for smaller models
+    static constexpr int CullClusterFaces = 1024;
+    const std::vector<CullCluster>& clusters() const { return _clusters; }
+
+    // changes whenever meshlets and clusters are rebuilt, never the same for two models
+    uint64_t clusterGeneration() const { return _clusterGeneration; }
+
+    // repacks the mesh into one 16 byte vertex per distinct v/vt/vn corner: positions as 16 bit fractions of the
+    // bounding box, uvs as 16 bit fractions of the uv range and normals octahedral encoded in 2x16 bits. corners
+    // share a single index stream, 16 bit when the vertex count allows. the float attributes are released and the
+    // accessors below decode on fetch, so renderers and shaders need no changes. call once the mesh is complete
+    void quantize()
+    {
+        if (_quantized || _vertIndices.empty()) return;
+
+        AABB uvBounds;
+        for (const vec2& uv : _texCoords) {
+            uvBounds.expand(vec3(uv, 0));
+        }
+        _quant.posMin = _bounds.min;
+        _quant.posScale = glm::max(_bounds.extent(), vec3(1e-20f)) / 65535.f;
+        _quant.uvMin = _texCoords.empty() ? vec2(0) : vec2(uvBounds.min);
+        _quant.uvScale = _texCoords.empty() ? vec2(0) : glm::max(vec2(uvBounds.extent()), vec2(1e-20f)) / 65535.f;
+
+        struct CornerHash
+        {
+            size_t operator()(const glm::ivec3& c) const
+            {
+                return ((size_t)(uint32_t)c.x * 73856093) ^ ((size_t)(uint32_t)c.y * 19349663)
+                       ^ ((size_t)(uint32_t)c.z * 83492791);
+            }
+        };
+        std::unordered_map<glm::ivec3, uint32_t, CornerHash> unique;
+        std::vector<uint32_t> indices(_vertIndices.size());
+        for (size_t i = 0; i < _vertIndices.size(); i++) {
+            glm::ivec3 c(vertexIndex(i), texcoordIndex(i), normalIndex(i));
+            auto [it, inserted] = unique.try_emplace(c, _packed.size());
+            if (inserted) {
+                _packed.push_back(packVertex(vertex(c.x), texcoord(c.y), normal(c.z)));
+            }
+            indices[i] = it->second;
+        }
+
+        if (_packed.size() <= 65536) {
+            _indices16.assign(indices.begin(), indices.end());
+            _vertIndices = {};
+        }
+        else {
+            _vertIndices.assign(indices.begin(), indices.end());
+        }
+        _vertices = {};
+        _texCoords = {};
+        _norms = {};
+        _texIndices = {};
+        _normIndices = {};
+        _quantized = true;
+        computeClusters();  // positions moved by up to half a quantization step
     }
 
-    void setVertices(std::vector<vec3>&& vertices) { _vertices = std::move(vertices); }
-    void setIndices(std::vector<int>&& indices) { _vertIndices = std::move(indices); }
-    void setTexCoords(std::vector<vec2>&& texCoords) { _texCoords = std::move(texCoords); }
+    bool quantized() const { return _quantized; }
 
-    int faces() const { return _vertIndices.size() / 3; }
+    // bytes held by vertex attributes and index streams
+    size_t geometryBytes() const
+    {
+        return _vertices.size() * sizeof(vec3) + _texCoords.size() * sizeof(vec2) + _norms.size() * sizeof(vec3)
+               + (_vertIndices.size() + _texIndices.size() + _normIndices.size()) * sizeof(int)
+               + _packed.size() * sizeof(PackedVertex) + _indices16.size() * sizeof(uint16_t);
+    }
 
     vec3 vertex(uint i) const
     {
+        if (_quantized) {
+            if (i < _packed.size()) {
+                const uint16_t* q = _packed[i].pos;
+                return _quant.posMin + vec3(q[0], q[1], q[2]) * _quant.posScale;
+            }
+            return {};
+        }
         if (i < _vertices.size()) {
             return _vertices[i];
         }
@@ -283,6 +1012,9 @@ public:
 
     int vertexIndex(uint i) const
     {
+        if (i < _indices16.size()) {
+            return _indices16[i];
+        }
         if (i < _vertIndices.size()) {
 
             return _vertIndices[i];
@@ -292,6 +1024,13 @@ public:
 
     vec2 texcoord(uint i) const
     {
+        if (_quantized) {
+            if (i < _packed.size()) {
+                const uint16_t* q = _packed[i].uv;
+                return _quant.uvMin + vec2(q[0], q[1]) * _quant.uvScale;
+            }
+            return {};
+        }
         if (i < _texCoords.size()) {
             return _texCoords[i];
         }
@@ -300,6 +1039,7 @@ public:
 
     int texcoordIndex(uint i) const
     {
+        if (_quantized) return vertexIndex(i);
         if (i < _texIndices.size()) {
             return _texIndices[i];
         }
@@ -308,6 +1048,12 @@ public:
 
     vec3 normal(uint i) const
     {
+        if (_quantized) {
+            if (i < _packed.size()) {
+                return octDecode(_packed[i].normal);
+            }
+            return {};
+        }
         if (i < _norms.size()) {
             return _norms[i];
         }
@@ -316,12 +1062,14 @@ public:
 
     vec3 normal(const vec2& uvf) const
     {
-        Color c = _normalMap.pixel(uvf[0] * _normalMap.width(), uvf[1] * _normalMap.height());
+        ImagePtr normalMap = texture(TextureSlot::Normal);
+        Color c = normalMap->pixel(uvf[0] * normalMap->width(), uvf[1] * normalMap->height());
         return vec3((double)c.color[0], (double)c.color[1], (double)c.color[2]) * 2.f / 255.f - vec3(1, 1, 1);
     }
 
     int normalIndex(uint i) const
     {
+        if (_quantized) return vertexIndex(i);
         if (i < _normIndices.size()) {
             return _normIndices[i];
         }
@@ -343,150 +1091,2698 @@ public:
         return nullptr;
     }
 
-    const Image& diffuse() const { return _diffuseMap; }
-    const Image& specular() const { return _specularMap; }
+    // resolves the texture through the cache once and keeps a weak reference to it, later calls only go back to
+    // the cache's lock after it evicted the image. hits refresh the texture's usage stamp for the cache's lru order
+    ImagePtr texture(TextureSlot slot) const
+    {
+        const TextureRef& ref = _maps[(int)slot];
+        if (ref.path.empty()) return placeholder(slot);
+        if (auto resolved = ref.resolved.load(std::memory_order_acquire)) {
+            if (ImagePtr img = resolved->image.lock()) {
+                resolved->usage->touch();
+                return img->empty() ? placeholder(slot) : img;
+            }
+        }
+        if (!ref.arrived.load(std::memory_order_acquire)) {
+            if (ref.ready.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return placeholder(slot);
+            ref.arrived.store(true, std::memory_order_release);
+        }
+
+        std::shared_ptr<TextureCache::Usage> usage;
+        ImagePtr img = TextureCache::global().acquire(ref.path, _textureLevel, &usage);
+        ref.resolved.store(std::make_shared<const ResolvedTexture>(img, std::move(usage)), std::memory_order_release);
+        return img->empty() ? placeholder(slot) : img;
+    }
+
+    ImagePtr diffuse() const { return texture(TextureSlot::Diffuse); }
+    ImagePtr specular() const { return texture(TextureSlot::Specular); }
+
+private:
+    struct PackedVertex
+    {
+        uint16_t pos[3];
+        uint16_t uv[2];
+        uint32_t normal;
+    };
+    static_assert(sizeof(PackedVertex) == 16);
+
+    struct QuantParams
+    {
+        vec3 posMin, posScale;
+        vec2 uvMin, uvScale;
+    };
+
+    size_t indexCount() const { return _indices16.empty() ? _vertIndices.size() : _indices16.size(); }
+
+    // the sphere is centered on the box, looser than a minimal one but a single extra pass
+    static BoundingSphere sphereAround(const AABB& box, auto&& forEachPoint)
+    {
+        BoundingSphere ret;
+        if (box.empty()) return ret;
+        ret.center = box.center();
+        float r2 = 0;
+        forEachPoint([&](const vec3& v) { r2 = std::max(r2, glm::dot(v - ret.center, v - ret.center)); });
+        ret.radius = std::sqrt(r2);
+        return ret;
+    }
+
+    void computeBounds()
+    {
+        _bounds = {};
+        for (const vec3& v : _vertices) {
+            _bounds.expand(v);
+        }
+        _sphere = sphereAround(_bounds, [this](auto&& f) {
+            for (const vec3& v : _vertices) {
+                f(v);
+            }
+        });
+    }
+
+    // 10 bits per axis interleaved
+    static uint64_t morton3(glm::uvec3 q)
+    {
+        uint64_t ret = 0;
+        for (int b = 0; b < 10; b++) {
+            for (int axis = 0; axis < 3; axis++) {
+                ret |= (uint64_t)((q[axis] >> b) & 1) << (b * 3 + axis);
+            }
+        }
+        return ret;
+    }
+
+    void computeClusters()
+    {
+        static std::atomic<uint64_t> generations{ 0 };
+        _clusterGeneration = ++generations;
+        _meshlets.clear();
+        _meshletFaces.clear();
+        _clusters.clear();
+        const int faceCount = faces();
+        if (!faceCount || _bounds.empty()) return;
+
+        // cell << 30 | morton code of the centroid
+        std::vector<std::pair<uint64_t, uint32_t>> order(faceCount);
+        std::vector<vec3> normals(faceCount);
+        const vec3 scale = 1023.f / glm::max(_bounds.extent(), vec3(1e-20f));
+        for (int f = 0; f < faceCount; f++) {
+            vec3 a = vertex(vertexIndex(f * 3)), b = vertex(vertexIndex(f * 3 + 1)), c = vertex(vertexIndex(f * 3 + 2));
+            vec3 n = glm::cross(b - a, c - a);
+            float len = glm::length(n);
+            normals[f] = len > 0 ? n / len : vec3(0);
+
+            uint32_t oct = octEncode(normals[f]);
+            uint64_t cell = ((oct & 0xffff) ^ 0x8000) >> 13 | (((oct >> 16) ^ 0x8000) >> 13) << 3;
+            glm::uvec3 q(glm::clamp(((a + b + c) / 3.f - _bounds.min) * scale, vec3(0), vec3(1023)));
+            order[f] = { cell << 30 | morton3(q), (uint32_t)f };
+        }
+        std::sort(order.begin(), order.end());
+
+        for (size_t i = 0; i < order.size();) {
+            size_t end = i + 1;
+            while (end < order.size() && end - i < MeshletFaces && order[end].first >> 30 == order[i].first >> 30) {
+                end++;
+            }
+
+            Meshlet m{ (uint32_t)_meshletFaces.size(), (uint32_t)(end - i), {}, {}, vec3(0), -1.f };
+            for (size_t j = i; j < end; j++) {
+                _meshletFaces.push_back(order[j].second);
+                m.coneAxis += normals[order[j].second];
+            }
+            auto forEachPoint = [&](auto&& f) {
+                for (uint32_t j = m.first; j < m.first + m.count; j++) {
+                    for (int k = 0; k < 3; k++) {
+                        f(vertex(vertexIndex(_meshletFaces[j] * 3 + k)));
+                    }
+                }
+            };
+            forEachPoint([&](const vec3& v) { m.bounds.expand(v); });
+            m.sphere = sphereAround(m.bounds, forEachPoint);
+
+            float axisLen = glm::length(m.coneAxis);
+            if (axisLen > 1e-6f) {
+                m.coneAxis /= axisLen;
+                m.coneCos = 1.f;
+                for (uint32_t j = m.first; j < m.first + m.count; j++) {
+                    const vec3& n = normals[_meshletFaces[j]];
+                    if (n != vec3(0)) m.coneCos = std::min(m.coneCos, glm::dot(n, m.coneAxis));
+                }
+            }
+            _meshlets.push_back(m);
+            i = end;
+        }
+
+        if (faceCount <= 2 * CullClusterFaces) return;
+        const int perCluster = CullClusterFaces / MeshletFaces;
+        for (int first = 0; first < (int)_meshlets.size(); first += perCluster) {
+            CullCluster c{ first, std::min(perCluster, (int)_meshlets.size() - first), {}, {} };
+            for (int i = first; i < first + c.meshletCount; i++) {
+                c.bounds.expand(_meshlets[i].bounds.min);
+                c.bounds.expand(_meshlets[i].bounds.max);
+            }
+            c.sphere = sphereAround(c.bounds, [&](auto&& f) {
+                for (int i = first; i < first + c.meshletCount; i++) {
+                    const Meshlet& m = _meshlets[i];
+                    for (uint32_t j = m.first; j < m.first + m.count; j++) {
+                        for (int k = 0; k < 3; k++) {
+                            f(vertex(vertexIndex(_meshletFaces[j] * 3 + k)));
+                        }
+                    }
+                }
+            });
+            _clusters.push_back(c);
+        }
+    }
+
+    PackedVertex packVertex(const vec3& pos, const vec2& uv, const vec3& normal) const
+    {
+        auto unorm16 = [](float v) { return (uint16_t)std::clamp(std::lround(v), 0l, 65535l); };
+        PackedVertex ret;
+        vec3 p = (pos - _quant.posMin) / _quant.posScale;
+        for (int i = 0; i < 3; i++) {
+            ret.pos[i] = unorm16(p[i]);
+        }
+        vec2 t = _quant.uvScale.x > 0 ? (uv - _quant.uvMin) / _quant.uvScale : vec2(0);
+        for (int i = 0; i < 2; i++) {
+            ret.uv[i] = unorm16(t[i]);
+        }
+        ret.normal = octEncode(normal);
+        return ret;
+    }
+
+    static uint32_t octEncode(const vec3& n)
+    {
+        float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+        if (l1 == 0) return 0;
+        vec2 e = vec2(n) / l1;
+        if (n.z < 0) {
+            e = (1.f - glm::abs(vec2(e.y, e.x))) * vec2(e.x >= 0 ? 1 : -1, e.y >= 0 ? 1 : -1);
+        }
+        auto snorm16 = [](float v) { return (uint16_t)(int16_t)std::lround(std::clamp(v, -1.f, 1.f) * 32767.f); };
+        return snorm16(e.x) | (uint32_t)snorm16(e.y) << 16;
+    }
+
+    static vec3 octDecode(uint32_t packed)
+    {
+        vec2 e = vec2((int16_t)(packed & 0xffff), (int16_t)(packed >> 16)) / 32767.f;
+        vec3 n(e.x, e.y, 1.f - std::abs(e.x) - std::abs(e.y));
+        float t = std::max(-n.z, 0.f);
+        n.x += n.x >= 0 ? -t : t;
+        n.y += n.y >= 0 ? -t : t;
+        float len = glm::length(n);
+        return len > 0 ? n / len : n;
+    }
+
+    struct Corner
+    {
+        int v, t, n;  // -1 for an attribute the face does not reference
+    };
+
+    static int objIndex(long idx, size_t count) { return idx > 0 ? idx - 1 : (idx < 0 ? (long)count + idx : -1); }
+
+    // splits a polygon into triangles (indices into corners) keeping its winding. convex quads take the shorter
+    // diagonal, larger polygons are ear clipped in the plane of their newell normal so concave faces stay covered
+    void triangulate(const std::vector<Corner>& corners, std::vector<int>& tris) const
+    {
+        tris.clear();
+        const int n = corners.size();
+        if (n == 3) {
+            tris = { 0, 1, 2 };
+            return;
+        }
+
+        auto pos = [&](int i) { return vertex(corners[i].v); };
+        if (n == 4) {
+            // a diagonal stays inside when both halves it cuts keep the same winding, for concave quads that's
+            // only the one through the reflex corner
+            auto inside = [&](int a, int b, int c, int d) {
+                return glm::dot(glm::cross(pos(b) - pos(a), pos(c) - pos(a)),
+                                glm::cross(pos(c) - pos(a), pos(d) - pos(a)))
+                       > 0;
+            };
+            bool inside02 = inside(0, 1, 2, 3), inside13 = inside(1, 2, 3, 0);
+            if (inside02 != inside13 ? inside02
+                                     : glm::distance(pos(0), pos(2)) <= glm::distance(pos(1), pos(3))) {
+                tris = { 0, 1, 2, 0, 2, 3 };
+            }
+            else {
+                tris = { 0, 1, 3, 1, 2, 3 };
+            }
+            return;
+        }
+
+        vec3 normal(0.f);
+        for (int i = 0; i < n; i++) {
+            normal += glm::cross(pos(i), pos((i + 1) % n));
+        }
+        vec3 helper = std::abs(normal.x) > 0.9f * glm::length(normal) ? vec3(0, 1, 0) : vec3(1, 0, 0);
+        vec3 axisU = glm::normalize(glm::cross(normal, helper));
+        vec3 axisV = glm::cross(glm::normalize(normal), axisU);
+        std::vector<vec2> pts(n);
+        for (int i = 0; i < n; i++) {
+            pts[i] = { glm::dot(pos(i), axisU), glm::dot(pos(i), axisV) };
+        }
+
+        auto cross2 = [](vec2 a, vec2 b, vec2 c) { return (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x); };
+        std::vector<int> ring(n);
+        for (int i = 0; i < n; i++) {
+            ring[i] = i;
+        }
+        for (int guard = 0; ring.size() > 3 && guard < n * n; guard++) {
+            const int m = ring.size();
+            bool clipped = false;
+            for (int i = 0; i < m && !clipped; i++) {
+                int a = ring[(i + m - 1) % m], b = ring[i], c = ring[(i + 1) % m];
+                if (cross2(pts[a], pts[b], pts[c]) <= 0) continue;  // reflex corner
+
+                bool ear = true;
+                for (int k : ring) {
+                    if (k == a || k == b || k == c) continue;
+                    if (cross2(pts[a], pts[b], pts[k]) >= 0 && cross2(pts[b], pts[c], pts[k]) >= 0
+                        && cross2(pts[c], pts[a], pts[k]) >= 0) {
+                        ear = false;
+                        break;
+                    }
+                }
+                if (ear) {
+                    tris.insert(tris.end(), { a, b, c });
+                    ring.erase(ring.begin() + i);
+                    clipped = true;
+                }
+            }
+            if (!clipped) break;  // degenerate outline, fan the rest
+        }
+        for (size_t i = 1; i + 1 < ring.size(); i++) {
+            tris.insert(tris.end(), { ring[0], ring[i], ring[i + 1] });
+        }
+    }
+
+    struct ResolvedTexture
+    {
+        std::weak_ptr<Image> image;  // expires when the cache evicts it
+        std::shared_ptr<TextureCache::Usage> usage;
+    };
+
+    struct TextureRef
+    {
+        std::string path;
+        std::shared_future<void> ready;  // pending prefetch, does not keep the image resident
+        mutable std::atomic<bool> arrived{ false };
+        mutable std::atomic<std::shared_ptr<const ResolvedTexture>> resolved;  // by texture()
+    };
+
+    // 1x1 stand-in sampled while the real texture is still loading
+    static const ImagePtr& placeholder(TextureSlot slot)
+    {
+        static const std::array<ImagePtr, (int)TextureSlot::Count> images = [] {
+            std::array<ImagePtr, (int)TextureSlot::Count> ret;
+            const Color colors[] = { { 128, 128, 255, 255 }, { 255, 255, 255, 255 }, { 0, 0, 0, 255 } };
+            for (int i = 0; i < (int)TextureSlot::Count; i++) {
+                ret[i] = std::make_shared<Image>(1, 1, Format::RGBA);
+                ret[i]->setPixel(0, 0, colors[i]);
+            }
+            return ret;
+        }();
+        return images[(int)slot];
+    }
 
-private:
     std::vector<vec3> _vertices;
     std::vector<vec2> _texCoords;
     std::vector<vec3> _norms;
     std::vector<int> _vertIndices;
     std::vector<int> _texIndices;
     std::vector<int> _normIndices;
+    AABB _bounds;
+    BoundingSphere _sphere;
+    std::vector<Meshlet> _meshlets;
+    std::vector<uint32_t> _meshletFaces;
+    std::vector<CullCluster> _clusters;
+    uint64_t _clusterGeneration{ 0 };
+
+    // quantized layout, see quantize()
+    bool _quantized{ false };
+    QuantParams _quant{};
+    std::vector<PackedVertex> _packed;
+    std::vector<uint16_t> _indices16;
+
+    std::array<TextureRef, (int)TextureSlot::Count> _maps;
+    int _textureLevel{ 0 };
+    bool _lazyTextures{ false };
+
+    std::array<ImagePtr, 10> _textures;
+};
+using ModelPtr = std::shared_ptr<Model>;
+
+vec3 barycentricLine(const vec2 tri[2], const vec2 p)
+{
+    double a = glm::distance(p, tri[0]) / glm::distance(tri[0], tri[1]);
+    return vec3{ 1 - a, a, 0 };
+}
+
+vec3 barycentric(const vec2 tri[3], const vec2& P)
+{
+    glm::mat3 ABC = { vec3(tri[0], 1.0), vec3(tri[1], 1.0), vec3(tri[2], 1.0) };
+
+    // for a degenerate triangle generate negative coordinates, it will be thrown away by the rasterizator
+    if (glm::determinant(ABC) < 1e-3) return { -1, 1, 1 };
+
+    return glm::inverse(ABC) * vec3(P, 1.0);
+}
+
+// draws recorded for later, possibly repeated, replay with Render::execute(). state is referenced through small
+// per buffer tables so a command is 32 bytes, after reserve() recording and sorting don't allocate unless a new
+// model or shader shows up. a buffer is independent of any Render and can be recorded on any thread
+class CommandBuffer
+{
+public:
+    struct Command
+    {
+        uint64_t key;  // sort key, the low 32 bits hold the recording order
+        int start;
+        int count;
+        int instanceCount;  // 0 for draws that aren't instanced
+        uint16_t model;
+        uint16_t shader;
+        PrimitiveType mode;
+        bool indexed;
+    };
+
+    void reserve(size_t commands) { _commands.reserve(commands); }
+
+    // drops commands and state but keeps the storage
+    void reset()
+    {
+        _commands.clear();
+        _models.clear();
+        _shaders.clear();
+    }
+
+    // like Render, draws use the model and shader set last
+    void setModel(const ModelPtr& model) { _model = stateIndex(_models, model); }
+    void setShader(const ShaderPtr& shader) { _shader = stateIndex(_shaders, shader); }
+
+    void drawArray(PrimitiveType mode, int start, int vertexCount) { record(mode, start, vertexCount, false); }
+    void drawIndex(PrimitiveType mode, int start, int indexCount) { record(mode, start, indexCount, true); }
+
+    // replays with the instance transforms the render holds at that time
+    void drawIndexInstanced(PrimitiveType mode, int start, int indexCount, int instanceCount)
+    {
+        if (instanceCount > 0) record(mode, start, indexCount, true, instanceCount);
+    }
+
+    // groups draws by shader, then model, keeping the recording order inside a group
+    void sortByState()
+    {
+        for (auto& c : _commands) {
+            setKey(c, (uint32_t)c.shader << 16 | c.model);
+        }
+        sort();
+    }
+
+    // front to back by the view depth of each model's bounds center, clip w or clip z for orthographic
+    // projections, back to front for blending. draws centered behind the eye or without bounds go last either
+    // way. instanced draws sort by the bounds of the model itself, their instance transforms are not applied
+    void sortByDepth(const glm::mat4& viewProj, bool frontToBack = true)
+    {
+        const bool ortho = viewProj[0][3] == 0 && viewProj[1][3] == 0 && viewProj[2][3] == 0;
+        for (auto& c : _commands) {
+            const AABB& bounds = _models[c.model]->bounds();
+            float key = std::numeric_limits<float>::max();
+            if (!bounds.empty()) {
+                vec4 p = viewProj * vec4(bounds.center(), 1.f);
+                float depth = ortho ? p.z : p.w;
+                if (ortho || p.w > 0) key = frontToBack ? depth : -depth;
+            }
+            uint32_t bits = std::bit_cast<uint32_t>(key);
+            setKey(c, bits & 0x80000000u ? ~bits : bits | 0x80000000u);  // orders like the float
+        }
+        sort();
+    }
+
+    // back to the recording order
+    void sortByRecording()
+    {
+        for (auto& c : _commands) {
+            setKey(c, 0);
+        }
+        sort();
+    }
+
+    size_t size() const { return _commands.size(); }
+    bool empty() const { return _commands.empty(); }
+    auto begin() const { return _commands.begin(); }
+    auto end() const { return _commands.end(); }
+
+    const ModelPtr& model(const Command& c) const { return _models[c.model]; }
+    const ShaderPtr& shader(const Command& c) const { return _shaders[c.shader]; }
+
+private:
+    template <class T>
+    static uint16_t stateIndex(std::vector<std::shared_ptr<T>>& table, const std::shared_ptr<T>& state)
+    {
+        auto it = std::find(table.begin(), table.end(), state);
+        if (it != table.end()) return it - table.begin();
+        table.push_back(state);
+        return table.size() - 1;
+    }
+
+    static void setKey(Command& c, uint32_t high) { c.key = (uint64_t)high << 32 | (uint32_t)c.key; }
+
+    void record(PrimitiveType mode, int start, int count, bool indexed, int instanceCount = 0)
+    {
+        if (_models.empty() || _shaders.empty()) return;
+        _commands.push_back({ _commands.size(), start, count, instanceCount, _model, _shader, mode, indexed });
+    }
+
+    void sort()
+    {
+        std::sort(_commands.begin(), _commands.end(), [](const Command& a, const Command& b) { return a.key < b.key; });
+    }
+
+    std::vector<Command> _commands;
+    std::vector<ModelPtr> _models;
+    std::vector<ShaderPtr> _shaders;
+    uint16_t _model{ 0 };
+    uint16_t _shader{ 0 };
+};
+
+// low resolution depth of designated occluders for rejecting hidden draws before any of their vertex work. depth
+// is ndc z / w over the ndc square. occluders are rasterized conservatively: a texel only takes a triangle's depth
+// when the triangle covers all of it, and then the triangle's farthest depth over it. a box whose nearest depth is
+// behind the stored depth of every texel it overlaps is therefore hidden
+class OcclusionBuffer
+{
+public:
+    OcclusionBuffer(int width = 256, int height = 128)
+      : _width(width)
+      , _height(height)
+      , _depth(width * height, std::numeric_limits<float>::max())
+    {}
+
+    int width() const { return _width; }
+    int height() const { return _height; }
+    const std::vector<float>& depth() const { return _depth; }
+
+    void clear() { std::fill(_depth.begin(), _depth.end(), std::numeric_limits<float>::max()); }
+
+    // depth only, positions of the model's triangles go through mvp and nothing else. triangles crossing the
+    // near plane are skipped, which only makes the buffer less effective
+    void addOccluder(const Model& model, const glm::mat4& mvp)
+    {
+        JRENDER_TRACE_SCOPE("OcclusionBuffer::addOccluder");
+        for (int f = 0; f < model.faces(); f++) {
+            vec3 pts[3];
+            bool behind = false;
+            for (int i = 0; i < 3; i++) {
+                vec4 clip = mvp * vec4(model.vertex(model.vertexIndex(f * 3 + i)), 1.f);
+                behind |= clip.w <= 1e-6f;
+                pts[i] = toTexels(clip);
+            }
+            if (!behind) rasterize(pts);
+        }
+    }
+
+    // box in model space, mvp as for addOccluder
+    bool occluded(const AABB& box, const glm::mat4& mvp) const
+    {
+        if (box.empty()) return false;
+        vec3 lo(std::numeric_limits<float>::max()), hi(std::numeric_limits<float>::lowest());
+        for (int c = 0; c < 8; c++) {
+            vec3 corner{ c & 1 ? box.max.x : box.min.x, c & 2 ? box.max.y : box.min.y,
+                         c & 4 ? box.max.z : box.min.z };
+            vec4 clip = mvp * vec4(corner, 1.f);
+            if (clip.w <= 1e-6f) return false;
+            vec3 p = toTexels(clip);
+            lo = glm::min(lo, p);
+            hi = glm::max(hi, p);
+        }
+
+        int x0 = std::max((int)std::floor(lo.x), 0), x1 = std::min((int)std::ceil(hi.x), _width) - 1;
+        int y0 = std::max((int)std::floor(lo.y), 0), y1 = std::min((int)std::ceil(hi.y), _height) - 1;
+        if (x0 > x1 || y0 > y1) return false;  // off screen is the frustum test's call
+        for (int y = y0; y <= y1; y++) {
+            for (int x = x0; x <= x1; x++) {
+                if (_depth[y * _width + x] >= lo.z) return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    vec3 toTexels(const vec4& clip) const
+    {
+        vec3 ndc = vec3(clip) / clip.w;
+        return { (ndc.x + 1.f) * 0.5f * _width, (ndc.y + 1.f) * 0.5f * _height, ndc.z };
+    }
+
+    // texel (x, y) spans [x, x + 1] x [y, y + 1]. a triangle covers it when all four corners are inside, its depth
+    // is a plane, so the farthest point of the texel is one of the corners
+    void rasterize(const vec3 pts[3])
+    {
+        float area = (pts[1].x - pts[0].x) * (pts[2].y - pts[0].y) - (pts[2].x - pts[0].x) * (pts[1].y - pts[0].y);
+        if (std::abs(area) < 1e-6f) return;
+
+        // edge functions and depth as planes in the corner position
+        vec3 edges[3];
+        for (int i = 0; i < 3; i++) {
+            const vec3 &a = pts[i], &b = pts[(i + 1) % 3];
+            vec3 e{ a.y - b.y, b.x - a.x, a.x * b.y - a.y * b.x };
+            edges[i] = area > 0 ? e : -e;
+        }
+        vec3 d1 = pts[1] - pts[0], d2 = pts[2] - pts[0];
+        float dzdx = (d1.z * d2.y - d2.z * d1.y) / area;
+        float dzdy = (d2.z * d1.x - d1.z * d2.x) / area;
+        auto depthAt = [&](float x, float y) { return pts[0].z + dzdx * (x - pts[0].x) + dzdy * (y - pts[0].y); };
+
+        int x0 = std::max((int)std::ceil(std::min({ pts[0].x, pts[1].x, pts[2].x })), 0);
+        int x1 = std::min((int)std::floor(std::max({ pts[0].x, pts[1].x, pts[2].x })), _width) - 1;
+        int y0 = std::max((int)std::ceil(std::min({ pts[0].y, pts[1].y, pts[2].y })), 0);
+        int y1 = std::min((int)std::floor(std::max({ pts[0].y, pts[1].y, pts[2].y })), _height) - 1;
+        for (int y = y0; y <= y1; y++) {
+            for (int x = x0; x <= x1; x++) {
+                bool covered = true;
+                float depth = std::numeric_limits<float>::lowest();
+                for (int c = 0; c < 4 && covered; c++) {
+                    float cx = x + (c & 1), cy = y + (c >> 1);
+                    for (const auto& e : edges) {
+                        covered &= e.x * cx + e.y * cy + e.z >= 0;
+                    }
+                    depth = std::max(depth, depthAt(cx, cy));
+                }
+                if (covered) _depth[y * _width + x] = std::min(_depth[y * _width + x], depth);
+            }
+        }
+    }
+
+    int _width;
+    int _height;
+    std::vector<float> _depth;
+};
+
+// per frame counters, enabled with Render::setStatsEnabled. every thread counts into its own block and the blocks
+// are merged by Render::stats(), stage times are summed over all threads
+struct PipelineStats
+{
+    uint64_t verticesShaded{ 0 };  // binned triangles run vs again in the raster stage of every tile they touch
+    uint64_t drawsCulled{ 0 };      // draws whose model is outside the view
+    uint64_t instancesCulled{ 0 };  // whole instances skipped before vertex shading
+    uint64_t clustersCulled{ 0 };
+    uint64_t drawsOccluded{ 0 };     // draws and instances hidden behind the occlusion buffer
+    uint64_t clustersOccluded{ 0 };
+    uint64_t meshletsTested{ 0 };  // including the ones of culled clusters
+    uint64_t meshletsCulled{ 0 };  // outside the view or facing away, including the ones of culled clusters
+    uint64_t clusterSorts{ 0 };    // front to back orders recomputed for a turned view
+    uint64_t primitivesSubmitted{ 0 };
+    uint64_t primitivesClipped{ 0 };  // entirely outside the frame
+    uint64_t primitivesCulled{ 0 };   // back facing or degenerate
+    uint64_t pixelsCovered{ 0 };
+    uint64_t depthTestsPassed{ 0 };
+    uint64_t depthTestsFailed{ 0 };
+    uint64_t fragmentsShaded{ 0 };
+    uint64_t fragmentsDiscarded{ 0 };
+    uint64_t pixelsWritten{ 0 };
+    uint64_t lightsShaded{ 0 };    // light evaluations of the deferred pass
+    uint64_t tilesRedrawn{ 0 };    // damaged tiles of an incremental frame
+    uint64_t blocksAccepted{ 0 };  // pixel blocks inside the triangle, drawn without per pixel coverage tests
+    uint64_t blocksRejected{ 0 };  // pixel blocks of the bounding box outside the triangle
+
+    uint64_t vertexNs{ 0 };    // vs and viewport transform
+    uint64_t setupNs{ 0 };     // clipping, culling and bounding box
+    uint64_t rasterNs{ 0 };    // coverage, depth test and pixel writes, fs excluded
+    uint64_t fragmentNs{ 0 };  // fs
+
+    PipelineStats& operator+=(const PipelineStats& o)
+    {
+        verticesShaded += o.verticesShaded;
+        drawsCulled += o.drawsCulled;
+        instancesCulled += o.instancesCulled;
+        clustersCulled += o.clustersCulled;
+        drawsOccluded += o.drawsOccluded;
+        clustersOccluded += o.clustersOccluded;
+        meshletsTested += o.meshletsTested;
+        meshletsCulled += o.meshletsCulled;
+        clusterSorts += o.clusterSorts;
+        primitivesSubmitted += o.primitivesSubmitted;
+        primitivesClipped += o.primitivesClipped;
+        primitivesCulled += o.primitivesCulled;
+        pixelsCovered += o.pixelsCovered;
+        depthTestsPassed += o.depthTestsPassed;
+        depthTestsFailed += o.depthTestsFailed;
+        fragmentsShaded += o.fragmentsShaded;
+        fragmentsDiscarded += o.fragmentsDiscarded;
+        pixelsWritten += o.pixelsWritten;
+        lightsShaded += o.lightsShaded;
+        tilesRedrawn += o.tilesRedrawn;
+        blocksAccepted += o.blocksAccepted;
+        blocksRejected += o.blocksRejected;
+        vertexNs += o.vertexNs;
+        setupNs += o.setupNs;
+        rasterNs += o.rasterNs;
+        fragmentNs += o.fragmentNs;
+        return *this;
+    }
+};
+
+// debug instrumentation, every combination is its own instantiation of the raster path
+enum DebugFeature : unsigned { DebugStats = 1u << 0, DebugHeatmap = 1u << 1 };
+
+// depth pre-pass: submit the frame's triangles once with DepthOnly, which rasterizes depth alone without fs or
+// pixel writes, then again with DepthEqual, which shades only the fragments at the final depth. each pixel is then
+// shaded once however much overdraw there is. fs must not discard, and vs must compute the same positions in both.
+// Visibility rasterizes depth plus the ids of the front most triangle, Render::resolveVisibility() shades them
+enum class DepthPass : uint8_t { Shade, DepthOnly, DepthEqual, Visibility };
+
+// the depth passes as features of the raster path next to the debug ones, PassMsaa is the multisampled Shade pass
+enum PassFeature : unsigned {
+    PassDepthOnly = 1u << 2,
+    PassDepthEqual = 1u << 3,
+    PassVisibility = 1u << 4,
+    PassMsaa = 1u << 5
+};
+
+// coarse shading: fs runs once per block of pixels of this size, width by height, and its result goes to every
+// pixel of the block that passes depth. ordered from fine to coarse
+enum class ShadingRate : uint8_t { Rate1x1, Rate1x2, Rate2x2, Rate4x4 };
+
+enum class HeatmapCounter { DepthTests, DepthPasses, Shaded };
+
+struct HeatmapTexel
+{
+    uint32_t depthTests{ 0 };
+    uint32_t depthPasses{ 0 };
+    uint32_t shaded{ 0 };  // fs invocations
+};
+
+// deferred shading targets, one plane per channel
+struct GBuffer
+{
+    std::array<std::vector<float>, 4> albedo;
+    std::array<std::vector<float>, 3> normal;
+    std::array<std::vector<float>, 3> position;
+    std::vector<uint8_t> written;  // whether the pixel's last write was a deferred one
+
+    size_t size() const { return written.size(); }
+
+    void resize(size_t size)
+    {
+        written.assign(size, 0);
+        for (auto& plane : albedo) {
+            plane.resize(size);
+        }
+        for (int c = 0; c < 3; c++) {
+            normal[c].resize(size);
+            position[c].resize(size);
+        }
+    }
+
+    void store(size_t i, const Surface& s)
+    {
+        written[i] = 1;
+        for (int c = 0; c < 4; c++) {
+            albedo[c][i] = s.albedo[c];
+        }
+        for (int c = 0; c < 3; c++) {
+            normal[c][i] = s.normal[c];
+            position[c][i] = s.position[c];
+        }
+    }
+};
+
+// pixel rectangle in setPixel coordinates
+struct Rect
+{
+    int x{ 0 }, y{ 0 }, width{ 0 }, height{ 0 };
+
+    bool empty() const { return width <= 0 || height <= 0; }
+};
+
+// dynamic resolution: picks the render size that keeps frames inside a time budget. frame times are smoothed and,
+// since the cost follows the pixel count, the scale moves with the square root of budget over time. steps smaller
+// than the dead band are held back so the size doesn't flicker between neighbours
+class ResolutionScaler
+{
+public:
+    ResolutionScaler(int maxWidth, int maxHeight, double budgetMs, float minScale = 0.25f)
+      : _maxWidth(maxWidth)
+      , _maxHeight(maxHeight)
+      , _width(maxWidth)
+      , _height(maxHeight)
+      , _budgetMs(budgetMs)
+      , _minScale(minScale)
+    {}
+
+    // feeds the time of the last frame, true when width() and height() changed
+    bool update(double frameMs)
+    {
+        _smoothedMs = _smoothedMs > 0 ? _smoothedMs + (frameMs - _smoothedMs) * Smoothing : frameMs;
+        float scale = std::clamp(_scale * (float)std::sqrt(_budgetMs / std::max(_smoothedMs, 1e-3)), _minScale, 1.f);
+        bool bound = scale == 1.f || scale == _minScale;
+        if (std::abs(scale - _scale) < DeadBand * _scale && !bound) return false;
+
+        int width = scale < 1.f ? std::max(8, (int)(_maxWidth * scale) & ~7) : _maxWidth;
+        int height = scale < 1.f ? std::max(8, (int)(_maxHeight * scale) & ~7) : _maxHeight;
+        _scale = scale;
+        if (width == _width && height == _height) return false;
+
+        // the smoothed time was measured at the old size
+        _smoothedMs *= (double)width * height / ((double)_width * _height);
+        _width = width;
+        _height = height;
+        return true;
+    }
+
+    int width() const { return _width; }
+    int height() const { return _height; }
+    float scale() const { return _scale; }
+
+private:
+    static constexpr double Smoothing = 0.2;
+    static constexpr float DeadBand = 0.05f;
+
+    int _maxWidth, _maxHeight;
+    int _width, _height;
+    double _budgetMs;
+    float _minScale;
+    float _scale{ 1.f };
+    double _smoothedMs{ 0 };
+};
+
+using InstanceBuffer = std::shared_ptr<const std::vector<glm::mat4>>;
+
+class Render
+{
+public:
+    Render(ImagePtr frame, ModelPtr model, ShaderPtr shader)
+      : _frame(std::move(frame))
+      , _model(std::move(model))
+      , _shader(std::move(shader))
+      , _zbuffer(_frame->width() * _frame->height(), std::numeric_limits<double>::max())
+      , _threadStats(ThreadPool::global().threadCount() + 1)
+    {}
+
+    // queued back end work references the render
+    ~Render() { finish(); }
+
+    void setViewport(int x, int y, int w, int h)
+    {
+        _viewport = glm::mat4(1.0f);
+
+        // 缩放 NDC 到窗口坐标的比例
+        _viewport[0][0] = w / 2.0f;
+        _viewport[1][1] = h / 2.0f;
+        _viewport[2][2] = 1;
+
+        // 平移到窗口坐标的偏移量
+        _viewport[3][0] = x + w / 2.0f;
+        _viewport[3][1] = y + h / 2.0f;
+        _viewport[3][2] = 0;
+    }
+
+    // resizes the frame and the depth buffer without reallocating up to the size the render was created with,
+    // e.g. for ResolutionScaler. the viewport has to be set again for the new size
+    void setResolution(int width, int height)
+    {
+        finish();
+        // tile rates belong to the old tile grid
+        if ((width + TileSize - 1) / TileSize != (_frame->width() + TileSize - 1) / TileSize
+            || (height + TileSize - 1) / TileSize != (_frame->height() + TileSize - 1) / TileSize) {
+            _tileRates.clear();
+        }
+        // so does the sample block grid, even at the same area
+        if (width != _frame->width() || height != _frame->height()) _sampleDepth.clear();
+        _frame->resize(width, height);
+        _zbuffer.resize((size_t)width * height);
+        _fullDamage = true;
+    }
+
+    // pipelined triangle draws return once their front end has binned them and rasterize in the background
+    // while the caller records the next draw, e.g. the next frame of an animation. clear() is queued behind them.
+    // call finish() before reading the frame, z buffer, stats or heatmaps
+    void setPipelined(bool enabled)
+    {
+        if (!enabled) finish();
+        _pipelined = enabled;
+    }
+
+    bool pipelined() const { return _pipelined; }
+
+    // incremental frames keep the color and depth of the previous frame. clear() only starts the frame, binned
+    // triangle draws run their front end and are kept, endFrame() rasterizes them into the tiles that changed. a
+    // draw changed when its screen space triangles differ from the ones of the draw at the same position in the
+    // previous frame, its old and new bounds are damaged then. uniforms that don't move vertices, like colors and
+    // textures, go unnoticed, invalidate() damages by hand. lines, points and shaders that can't be copied still
+    // draw straight into the frame and are lost in redrawn tiles
+    void setIncremental(bool enabled)
+    {
+        finish();
+        _incremental = enabled;
+        _previousDraws.clear();
+        recycleRetained();
+        _fullDamage = true;
+    }
+
+    bool incremental() const { return _incremental; }
+
+    void invalidate() { _fullDamage = true; }
+    void invalidate(const Rect& rect) { _invalidated.push_back(rect); }
+
+    // rasterizes the damaged tiles of an incremental frame and returns them merged into rectangles, only those
+    // need presenting. the resolve passes still cover the whole frame. without incremental frames it returns the
+    // whole frame
+    std::vector<Rect> endFrame()
+    {
+        JRENDER_TRACE_SCOPE("Render::endFrame");
+        finish();
+        const int width = _frame->width(), height = _frame->height();
+        if (!_incremental) return { Rect{ 0, 0, width, height } };
+
+        const int tilesX = (width + TileSize - 1) / TileSize;
+        const int tilesY = (height + TileSize - 1) / TileSize;
+        _damagedTiles.assign(tilesX * tilesY, _fullDamage);
+        auto damage = [&](const Rect& r) {
+            int x0 = std::max(r.x, 0), x1 = std::min(r.x + r.width, width);
+            int y0 = std::max(r.y, 0), y1 = std::min(r.y + r.height, height);
+            if (x0 >= x1 || y0 >= y1) return;
+            for (int ty = y0 / TileSize; ty <= (y1 - 1) / TileSize; ty++) {
+                for (int tx = x0 / TileSize; tx <= (x1 - 1) / TileSize; tx++) {
+                    _damagedTiles[ty * tilesX + tx] = 1;
+                }
+            }
+        };
+        for (size_t i = 0; i < std::max(_retained.size(), _previousDraws.size()); i++) {
+            const DrawDamage* now = i < _retained.size() ? &_retained[i].damage : nullptr;
+            const DrawDamage* before = i < _previousDraws.size() ? &_previousDraws[i] : nullptr;
+            if (now && before && now->hash == before->hash) continue;
+            if (now) damage(now->bounds);
+            if (before) damage(before->bounds);
+        }
+        for (const Rect& r : _invalidated) {
+            damage(r);
+        }
+
+        std::vector<int> tiles;
+        for (int t = 0; t < tilesX * tilesY; t++) {
+            if (_damagedTiles[t]) tiles.push_back(t);
+        }
+        ThreadPool::global().parallelFor(0, tiles.size(), 1, [&](int i0, int i1) {
+            for (int i = i0; i < i1; i++) {
+                redrawTile(tiles[i], tilesX);
+            }
+        });
+        if (_statsEnabled) threadStats().tilesRedrawn += tiles.size();
+
+        _previousDraws.clear();
+        for (const auto& d : _retained) {
+            _previousDraws.push_back(d.damage);
+        }
+        recycleRetained();
+        _fullDamage = false;
+        _invalidated.clear();
+        return damagedRects(tilesX, tilesY);
+    }
+
+    // applies to the draws that follow, lines and points don't write depth and are skipped by DepthOnly and
+    // Visibility
+    void setDepthPass(DepthPass pass) { _depthPass = pass; }
+
+    DepthPass depthPass() const { return _depthPass; }
+
+    // triangles drawn while deferred run Shader::surface instead of fs and fill the G-buffer, resolveDeferred()
+    // lights it into the frame. combines with every depth pass, lines and points stay forward
+    void setDeferred(bool enabled)
+    {
+        if (enabled != _deferred) finish();
+        _deferred = enabled;
+    }
+
+    bool deferred() const { return _deferred; }
+
+    void setLights(std::vector<PointLight> lights) { _lights = std::move(lights); }
+    void setAmbient(const vec3& ambient) { _ambient = ambient; }
+
+    const GBuffer& gbuffer() const { return _gbuffer; }
+
+    // writes every pixel a deferred triangle was drawn to last as albedo times ambient plus the lambert terms of
+    // the lights. tiles run in parallel, each gathers the lights whose radius reaches the box around its surface
+    // positions first, so a pixel only evaluates the lights that can affect its tile
+    void resolveDeferred()
+    {
+        JRENDER_TRACE_SCOPE("Render::resolveDeferred");
+        finish();
+        if (_gbuffer.size() != _zbuffer.size()) return;  // nothing deferred yet
+
+        const int tilesX = (_frame->width() + TileSize - 1) / TileSize;
+        const int tilesY = (_frame->height() + TileSize - 1) / TileSize;
+        ThreadPool::global().parallelFor(0, tilesX * tilesY, 1, [&](int t0, int t1) {
+            std::vector<const PointLight*> lights;
+            for (int t = t0; t < t1; t++) {
+                lightTile(t, tilesX, lights);
+            }
+        });
+    }
+
+    // per pixel drawID << 32 | primID of the visibility pass, EmptyVisibility where nothing was drawn. every
+    // instance of a draw has its own drawID
+    static constexpr uint64_t EmptyVisibility = ~0ull;
+    const std::vector<uint64_t>& visibility() const { return _visibility; }
+
+    // shades the visibility buffer: every covered pixel runs fs once with the barycentrics of its triangle, whose
+    // vertices are shaded again once per run of pixels that share it. tiles are resolved in parallel. the draws
+    // keep a copy of their shader, later uniform changes don't affect them
+    void resolveVisibility()
+    {
+        JRENDER_TRACE_SCOPE("Render::resolveVisibility");
+        finish();
+        if (_visibility.empty() || _visibilityDraws.empty()) return;
+        if (_heatmapEnabled) resizeHeatmap();
+        if (_deferred) resizeGBuffer();
+
+        switch ((_statsEnabled ? DebugStats : 0u) | (_heatmapEnabled ? DebugHeatmap : 0u)) {
+        case 0:
+            resolveTiles<0>();
+            break;
+        case DebugStats:
+            resolveTiles<DebugStats>();
+            break;
+        case DebugHeatmap:
+            resolveTiles<DebugHeatmap>();
+            break;
+        default:
+            resolveTiles<DebugStats | DebugHeatmap>();
+            break;
+        }
+    }
+
+    // multisampling for forward shaded triangles: coverage and depth are kept per sample, fs runs once per pixel and
+    // triangle, at the pixel center or the first covered sample off the edge, and its color goes to the covered
+    // samples that pass. 8x8 blocks whose pixels have all samples alike keep the color in the frame alone,
+    // resolveSamples() averages the other blocks into it. counts round down to 1, 2, 4 or 8. depth passes and
+    // deferred draws stay single sampled
+    void setSamples(int count)
+    {
+        finish();
+        _samples = count >= 8 ? 8 : count >= 4 ? 4 : count >= 2 ? 2 : 1;
+        _sampleDepth.clear();
+    }
+
+    int samples() const { return _samples; }
+
+    // writes the average of every multisampled block to the frame, blocks stay multisampled for later draws
+    void resolveSamples()
+    {
+        JRENDER_TRACE_SCOPE("Render::resolveSamples");
+        finish();
+        if (_sampleBlocks.empty()) return;
+        const int width = _frame->width(), height = _frame->height(), n = _samples;
+        const int blocksY = (height + SampleBlock - 1) / SampleBlock;
+        ThreadPool::global().parallelFor(0, blocksY, 1, [&](int by0, int by1) {
+            for (int by = by0; by < by1; by++) {
+                for (int bx = 0; bx < _sampleBlocksX; bx++) {
+                    if (_sampleBlocks[by * _sampleBlocksX + bx]) continue;
+                    for (int y = by * SampleBlock; y < std::min((by + 1) * SampleBlock, height); y++) {
+                        for (int x = bx * SampleBlock; x < std::min((bx + 1) * SampleBlock, width); x++) {
+                            const Color* samples = &_sampleColors[((size_t)y * width + x) * n];
+                            int sum[4] = {};
+                            for (int i = 0; i < n; i++) {
+                                for (int c = 0; c < 4; c++) {
+                                    sum[c] += samples[i].color[c];
+                                }
+                            }
+                            Color color;
+                            for (int c = 0; c < 4; c++) {
+                                color.color[c] = (sum[c] + n / 2) / n;
+                            }
+                            _frame->setPixel(x, y, color);
+                        }
+                    }
+                }
+            }
+        });
+    }
+
+    // coarse shading of the triangles that follow, the coarser of it and the tile's rate applies. depth is still
+    // tested and written per pixel, multisampled draws ignore the rates
+    void setShadingRate(ShadingRate rate) { _shadingRate = rate; }
+
+    ShadingRate shadingRate() const { return _shadingRate; }
+
+    // one rate per 64 pixel tile, rows first. empty turns them off, setResolution() does too when the tile grid
+    // changes
+    void setTileShadingRates(std::vector<ShadingRate> rates)
+    {
+        finish();
+        _tileRates = std::move(rates);
+    }
+
+    const std::vector<ShadingRate>& tileShadingRates() const { return _tileRates; }
+
+    // sets every tile's rate from the frame as drawn, for the next frame: the coarsest rate for which the luminance
+    // of pixels one block apart varies by at most maxVariance. pixels one block apart come from different fs runs
+    // even when the frame was shaded coarsely, so coarse tiles still see the detail of their content
+    void adaptShadingRates(float maxVariance = 1e-4f)
+    {
+        JRENDER_TRACE_SCOPE("Render::adaptShadingRates");
+        finish();
+        const int width = _frame->width(), height = _frame->height();
+        const int tilesX = (width + TileSize - 1) / TileSize;
+        const int tilesY = (height + TileSize - 1) / TileSize;
+        _tileRates.resize(tilesX * tilesY);
+        ThreadPool::global().parallelFor(0, tilesX * tilesY, 1, [&](int t0, int t1) {
+            float luma[TileSize * TileSize];
+            for (int t = t0; t < t1; t++) {
+                const int x0 = (t % tilesX) * TileSize, y0 = (t / tilesX) * TileSize;
+                const int w = std::min(TileSize, width - x0), h = std::min(TileSize, height - y0);
+                for (int y = 0; y < h; y++) {
+                    for (int x = 0; x < w; x++) {
+                        Color c = _frame->readPixel(x0 + x, y0 + y);
+                        luma[y * TileSize + x] = (0.299f * c.r + 0.587f * c.g + 0.114f * c.b) / 255.f;
+                    }
+                }
+                // half the mean squared difference of the pairs dx, dy apart, the most varied 16x16 region
+                // counts so that empty background doesn't average the detail away
+                auto variance = [&](int dx, int dy) {
+                    double ret = 0;
+                    for (int ry = 0; ry < h; ry += 16) {
+                        for (int rx = 0; rx < w; rx += 16) {
+                            double sum = 0;
+                            int pairs = 0;
+                            for (int y = ry; y < std::min(ry + 16, h - dy); y++) {
+                                for (int x = rx; x < std::min(rx + 16, w - dx); x++) {
+                                    float d = luma[(y + dy) * TileSize + x + dx] - luma[y * TileSize + x];
+                                    sum += d * d;
+                                    pairs++;
+                                }
+                            }
+                            if (pairs) ret = std::max(ret, sum / (2 * pairs));
+                        }
+                    }
+                    return ret;
+                };
+                double tall = variance(0, 2), square = std::max(variance(2, 0), tall);
+                double coarse = std::max(variance(4, 0), variance(0, 4));
+                _tileRates[t] = coarse <= maxVariance   ? ShadingRate::Rate4x4
+                                : square <= maxVariance ? ShadingRate::Rate2x2
+                                : tall <= maxVariance   ? ShadingRate::Rate1x2
+                                                        : ShadingRate::Rate1x1;
+            }
+        });
+    }
+
+    // waits for every queued back end step, a no-op when nothing is in flight
+    void finish()
+    {
+        if (!_backEndDone.valid()) return;
+        ThreadPool::global().wait(_backEndDone);
+        _backEndDone = {};
+
+        // the draining task may still be on its way out of drainBackEnd()
+        std::unique_lock<std::mutex> lock(_backEndMutex);
+        _backEndIdle.wait(lock, [this] { return !_backEndRunning; });
+    }
+
+    // per instance transforms handed to vs as _instanceTransform by drawIndexInstanced, instances past the end
+    // and the other draws get the identity
+    void setInstanceTransforms(InstanceBuffer transforms) { _instances = std::move(transforms); }
+
+    // the transform the shaders apply in front of _instanceTransform. once set, every draw tests the model's
+    // bounding sphere and box against its frustum first and is dropped without shading a vertex when outside.
+    // instances are tested one by one, indexed triangle draws also per cluster and meshlet. meshlets facing away
+    // from the eye are dropped as well, for perspective projections and instance transforms that don't mirror
+    void setViewProj(const glm::mat4& viewProj)
+    {
+        _viewProj = viewProj;
+        _cullEnabled = true;
+    }
+
+    void disableCulling() { _cullEnabled = false; }
+
+    // with culling on, instances are drawn nearest first and meshlets of indexed triangle draws are emitted
+    // cluster by cluster from the nearest one, so the depth test rejects more fragments before fs. the cluster
+    // and meshlet order of a model is kept until the view direction turns by more than resortDegrees
+    void setFrontToBack(bool enabled, float resortDegrees = 15.f)
+    {
+        _frontToBack = enabled;
+        _resortCos = std::cos(glm::radians(resortDegrees));
+    }
+
+    // with culling on, draws, instances and clusters whose box is hidden in the buffer are skipped as well. the
+    // buffer has to be filled with the occluders of the current view before the draws, nullptr turns it off
+    void setOcclusionBuffer(std::shared_ptr<const OcclusionBuffer> occlusion) { _occlusion = std::move(occlusion); }
+
+    void setModel(ModelPtr model) { _model = std::move(model); }
+    void setShader(ShaderPtr shader) { _shader = std::move(shader); }
+
+    const std::vector<double>& zbuffer() const { return _zbuffer; }
+
+    // counting runs in its own instantiation of the pipeline, disabled draws pay nothing for it
+    void setStatsEnabled(bool enabled) { _statsEnabled = enabled; }
+
+    // counters accumulated since the last clear()
+    PipelineStats stats() const
+    {
+        PipelineStats ret;
+        for (const auto& t : _threadStats) {
+            ret += t.stats;
+        }
+        return ret;
+    }
+
+    void resetStats()
+    {
+        for (auto& t : _threadStats) {
+            t.stats = {};
+        }
+    }
+
+    // per pixel counts of depth tests, depth passes and fs invocations since the last clear(), like stats they
+    // are gathered in a separate instantiation of the pipeline
+    void setHeatmapEnabled(bool enabled) { _heatmapEnabled = enabled; }
+
+    const std::vector<HeatmapTexel>& heatmap() const { return _heatmap; }
+
+    // false color image of one counter laid out like the frame, black is zero and white is maxCount or above.
+    // maxCount 0 scales to the largest count in the frame
+    Image heatmapImage(HeatmapCounter counter, uint32_t maxCount = 0) const
+    {
+        Image img(_frame->width(), _frame->height(), Format::RGBA);
+        img.setFlipVertical(_frame->flipVertical());
+        if (_heatmap.empty()) return img;
+
+        auto count = [counter](const HeatmapTexel& t) {
+            return counter == HeatmapCounter::DepthTests ? t.depthTests
+                                                          : (counter == HeatmapCounter::DepthPasses ? t.depthPasses
+                                                                                                    : t.shaded);
+        };
+        if (!maxCount) {
+            for (const auto& t : _heatmap) {
+                maxCount = std::max(maxCount, count(t));
+            }
+        }
+
+        // black, blue, cyan, green, yellow, red, white
+        constexpr vec3 ramp[] = { { 0, 0, 0 }, { 0, 0, 1 }, { 0, 1, 1 }, { 0, 1, 0 },
+                                  { 1, 1, 0 }, { 1, 0, 0 }, { 1, 1, 1 } };
+        constexpr int segments = std::size(ramp) - 1;
+        for (int y = 0; y < img.height(); y++) {
+            for (int x = 0; x < img.width(); x++) {
+                float v = maxCount ? std::min(1.f, (float)count(_heatmap[y * img.width() + x]) / maxCount) : 0.f;
+                int i = std::min((int)(v * segments), segments - 1);
+                vec3 c = glm::mix(ramp[i], ramp[i + 1], v * segments - i) * 255.f;
+                img.setPixel(x, y, Color{ (uint8_t)c.r, (uint8_t)c.g, (uint8_t)c.b, 255 });
+            }
+        }
+        return img;
+    }
+
+    // writes <prefix>_frame.png next to one false color png per counter, the pngs are encoded concurrently
+    bool writeHeatmaps(const std::string& prefix) const
+    {
+        const std::pair<HeatmapCounter, const char*> maps[] = { { HeatmapCounter::DepthTests, "_depth_tests.png" },
+                                                                { HeatmapCounter::DepthPasses, "_depth_passes.png" },
+                                                                { HeatmapCounter::Shaded, "_shaded.png" } };
+        std::array<bool, std::size(maps) + 1> written{};
+        ThreadPool::global().parallelFor(0, written.size(), 1, [&](int i, int) {
+            written[i] = i ? heatmapImage(maps[i - 1].first).write(prefix + maps[i - 1].second)
+                           : _frame->write(prefix + "_frame.png");
+        });
+        return std::all_of(written.begin(), written.end(), [](bool w) { return w; });
+    }
+
+    void drawArray(PrimitiveType mode, int start, int vertexCount)
+    {
+        if (!cull(mode, start, vertexCount, 1, false, false)) return;
+        addVisibilityDraw(mode, start, 1, false);
+        draw(mode, [start](int i) { return start + i; });
+    }
+
+    void drawIndex(PrimitiveType mode, int start, int indexCount)
+    {
+        if (!cull(mode, start, indexCount, 1, false, true)) return;
+        addVisibilityDraw(mode, start, 1, true);
+        draw(mode, [this, start](int i) { return _model->vertexIndex(start + i); });
+    }
+
+    // draws the index range once per instance with _instanceID set, the triangles of all instances that survive
+    // culling are batched and binned as one stream
+    void drawIndexInstanced(PrimitiveType mode, int start, int indexCount, int instanceCount)
+    {
+        if (!cull(mode, start, indexCount, instanceCount, true, true)) return;
+        addVisibilityDraw(mode, start, instanceCount, true);
+        draw(mode, [this, start](int i) { return _model->vertexIndex(start + i); });
+    }
+
+    // replays the commands in their current order, the render's own model and shader are restored afterwards
+    void execute(const CommandBuffer& commands)
+    {
+        JRENDER_TRACE_SCOPE("Render::execute");
+        ModelPtr model = std::move(_model);
+        ShaderPtr shader = std::move(_shader);
+        for (const auto& c : commands) {
+            _model = commands.model(c);
+            _shader = commands.shader(c);
+            if (c.instanceCount) {
+                drawIndexInstanced(c.mode, c.start, c.count, c.instanceCount);
+            }
+            else if (c.indexed) {
+                drawIndex(c.mode, c.start, c.count);
+            }
+            else {
+                drawArray(c.mode, c.start, c.count);
+            }
+        }
+        _model = std::move(model);
+        _shader = std::move(shader);
+    }
+
+    void clear()
+    {
+        JRENDER_TRACE_SCOPE("Render::clear");
+        _visibilityDraws.clear();
+        if (_incremental) {
+            // the targets keep the previous frame, endFrame() clears the tiles it redraws
+            finish();
+            recycleRetained();
+            resetStats();
+            return;
+        }
+        // with stats on, the next front end counts while the back end is still queued, so drain instead
+        if (_pipelined && !_statsEnabled) {
+            enqueueBackEnd([this] { clearTargets(); });
+            return;
+        }
+        finish();
+        clearTargets();
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr int TileSize = 64;
+    static constexpr int SampleBlock = 8;  // pixels per side of a compressed block, divides TileSize
+    static constexpr int BatchSize = 256;         // triangles per front end job
+    static constexpr int SubpixelBits = 8;
+    static constexpr int CoverageBlock = 8;  // pixels per side of the blocks classified before the per pixel test
+    static constexpr int ParallelPixels = 4096;  // immediate triangles are split into row chunks of about this size
+
+    struct alignas(64) ThreadStats
+    {
+        PipelineStats stats;
+    };
+
+    // screen space triangle produced by the vertex stage. positions are snapped to 1/256 pixel and the edge
+    // functions are integers sampled at pixel centers, the one opposite each vertex gives its barycentric
+    struct TriangleSetup
+    {
+        int64_t edge[3];   // at the center of pixel (0, 0), minus one for edges the fill rule excludes
+        int64_t stepX[3];  // per pixel to the right
+        int64_t stepY[3];  // per pixel row
+        double invArea;
+        vec3 depth;
+        int vert[3];
+        int primID;
+        int instanceID;
+        int minX, maxX, minY, maxY;
+
+        void edgesAt(int x, int y, int64_t w[3]) const
+        {
+            for (int i = 0; i < 3; i++) {
+                w[i] = edge[i] + stepX[i] * x + stepY[i] * y;
+            }
+        }
+
+        static bool inside(const int64_t w[3]) { return (w[0] | w[1] | w[2]) >= 0; }
+
+        vec3 barycentric(const int64_t w[3]) const { return vec3(w[0] * invArea, w[1] * invArea, w[2] * invArea); }
+    };
+
+    // front end output of one batch of triangles, bins hold indices into tris per tile in submission order
+    struct Batch
+    {
+        std::vector<TriangleSetup> tris;
+        std::vector<std::vector<uint32_t>> bins;
+    };
+
+    // everything the back end of a binned draw reads. pipelined draws alternate between two slots so the front
+    // end of one draw fills a slot while the other one is rasterized
+    struct DrawSlot
+    {
+        std::vector<Batch> batches;
+        std::vector<ShaderPtr> shaders;  // one per worker plus one for threads outside the pool
+        ModelPtr model;
+        glm::mat4 viewport;
+        InstanceBuffer instances;
+        uint32_t drawID;                // of instance 0 in the visibility buffer
+        ShadingRate shadingRate;
+        std::shared_future<void> done;  // back end of the last draw using the slot
+    };
+
+    // what the visibility resolve needs to shade the triangles of one draw again
+    struct VisibilityDraw
+    {
+        uint32_t firstID;  // drawID of instance 0, the following instances count up from it
+        uint32_t instanceCount;
+        ModelPtr model;
+        ShaderPtr shader;
+        bool copied;  // false when the shader can't be copied, its tiles are then resolved on this thread
+        InstanceBuffer instances;
+        glm::mat4 viewport;
+        int start;
+        bool indexed;
+    };
+
+    // what endFrame() compares between the draws of consecutive incremental frames
+    struct DrawDamage
+    {
+        uint64_t hash{ 0 };  // of the draw's state and triangle setups
+        Rect bounds;         // pixels its triangles may cover
+    };
+
+    // a binned draw of an incremental frame waiting for endFrame()
+    struct RetainedDraw
+    {
+        std::unique_ptr<DrawSlot> slot;
+        std::function<void(int tile)> raster;
+        DrawDamage damage;
+    };
+
+    static uint64_t elapsedNs(Clock::time_point since)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - since).count();
+    }
+
+    PipelineStats& threadStats() { return _threadStats[ThreadPool::global().workerIndex()].stats; }
+
+    static const glm::mat4& instanceTransform(const InstanceBuffer& instances, int instanceID)
+    {
+        static const glm::mat4 identity{ 1.f };
+        return instances && instanceID < (int)instances->size() ? (*instances)[instanceID] : identity;
+    }
+
+    static bool visible(const Frustum& frustum, const BoundingSphere& sphere, const AABB& bounds)
+    {
+        return bounds.empty() || (frustum.intersects(sphere) && frustum.intersects(bounds));
+    }
+
+    // consecutive primitives [first, first + count) of the draw for one instance, offset is the position of the
+    // first one in the stream of all runs
+    struct DrawRun
+    {
+        int instanceID;
+        int first;
+        int count;
+        int offset;
+    };
+
+    void addRun(int instanceID, int first, int count)
+    {
+        if (!_runs.empty() && _runs.back().instanceID == instanceID
+            && _runs.back().first + _runs.back().count == first) {
+            _runs.back().count += count;
+            return;
+        }
+        int offset = _runs.empty() ? 0 : _runs.back().offset + _runs.back().count;
+        _runs.push_back({ instanceID, first, count, offset });
+    }
+
+    int runPrimitives() const { return _runs.empty() ? 0 : _runs.back().offset + _runs.back().count; }
+
+    // fills _runs with what survives culling, false when nothing does
+    bool cull(PrimitiveType mode, int start, int vertexCount, int instanceCount, bool instanced, bool indexed)
+    {
+        _runs.clear();
+        _drawInstances = instanced ? _instances : nullptr;
+        const int perPrimitive = mode == PrimitiveType::Triangle ? 3 : (mode == PrimitiveType::Line ? 2 : 1);
+        const int primCount = vertexCount / perPrimitive;
+        const Model& model = *_model;
+        const bool meshlets = _cullEnabled && indexed && mode == PrimitiveType::Triangle && start % 3 == 0
+                              && !model.meshlets().empty();
+        PipelineStats dummy;
+        PipelineStats& st = _statsEnabled ? threadStats() : dummy;
+
+        _instanceOrder.resize(instanceCount);
+        std::iota(_instanceOrder.begin(), _instanceOrder.end(), 0);
+        if (_cullEnabled && _frontToBack && instanceCount > 1) {
+            _instanceDepths.resize(instanceCount);
+            for (int i = 0; i < instanceCount; i++) {
+                vec4 plane = depthPlane(_viewProj * instanceTransform(_drawInstances, i));
+                _instanceDepths[i] = glm::dot(plane, vec4(model.bounds().center(), 1.f));
+            }
+            std::stable_sort(_instanceOrder.begin(), _instanceOrder.end(),
+                             [this](int a, int b) { return _instanceDepths[a] < _instanceDepths[b]; });
+        }
+
+        for (int instanceID : _instanceOrder) {
+            if (!_cullEnabled) {
+                addRun(instanceID, 0, primCount);
+                continue;
+            }
+
+            const glm::mat4& transform = instanceTransform(_drawInstances, instanceID);
+            Frustum frustum(_viewProj * transform);
+            if (!visible(frustum, model.boundingSphere(), model.bounds())) {
+                (instanced ? st.instancesCulled : st.drawsCulled)++;
+                continue;
+            }
+            if (_occlusion && _occlusion->occluded(model.bounds(), _viewProj * transform)) {
+                st.drawsOccluded++;
+                continue;
+            }
+            if (!meshlets) {
+                addRun(instanceID, 0, primCount);
+                continue;
+            }
+            cullMeshlets(_model, frustum, transform, instanceID, start / 3, primCount, st);
+        }
+        return !_runs.empty();
+    }
+
+    // a linear function of model space positions that grows away from the eye along the view direction, clip w
+    // for perspective projections and clip z for orthographic ones
+    static vec4 depthPlane(const glm::mat4& m)
+    {
+        vec4 w{ m[0][3], m[1][3], m[2][3], m[3][3] };
+        return glm::length(vec3(w)) > 1e-12f ? w : vec4{ m[0][2], m[1][2], m[2][2], m[3][2] };
+    }
+
+    // cluster indices nearest first along dir, and the meshlets of every cluster's range likewise
+    struct ClusterOrder
+    {
+        std::weak_ptr<const Model> model;
+        uint64_t generation;
+        vec3 dir;
+        std::vector<uint32_t> clusters;
+        std::vector<uint32_t> meshlets;
+    };
+
+    // orders of freed models are dropped, the ones of models whose clusters were rebuilt are sorted again
+    const ClusterOrder& clusterOrder(const ModelPtr& model, const vec3& dir, PipelineStats& st)
+    {
+        std::erase_if(_clusterOrders, [](const ClusterOrder& o) { return o.model.expired(); });
+        auto it = std::find_if(_clusterOrders.begin(), _clusterOrders.end(),
+                               [&](const ClusterOrder& o) { return o.model.lock() == model; });
+        if (it == _clusterOrders.end()) it = _clusterOrders.insert(it, { model, 0, dir, {}, {} });
+        const auto& clusters = model->clusters();
+        const auto& meshlets = model->meshlets();
+        if (it->generation == model->clusterGeneration() && glm::dot(it->dir, dir) >= _resortCos) return *it;
+
+        st.clusterSorts++;
+        it->generation = model->clusterGeneration();
+        it->dir = dir;
+        auto sortRange = [&](std::vector<uint32_t>& order, size_t begin, size_t end, auto center) {
+            std::iota(order.begin() + begin, order.begin() + end, (uint32_t)begin);
+            std::sort(order.begin() + begin, order.begin() + end,
+                      [&](uint32_t a, uint32_t b) { return glm::dot(dir, center(a)) < glm::dot(dir, center(b)); });
+        };
+        auto clusterCenter = [&](uint32_t c) { return clusters[c].sphere.center; };
+        auto meshletCenter = [&](uint32_t m) { return meshlets[m].sphere.center; };
+        it->clusters.resize(clusters.size());
+        it->meshlets.resize(meshlets.size());
+        sortRange(it->clusters, 0, clusters.size(), clusterCenter);
+        if (clusters.empty()) sortRange(it->meshlets, 0, meshlets.size(), meshletCenter);
+        for (const auto& c : clusters) {
+            sortRange(it->meshlets, c.firstMeshlet, c.firstMeshlet + c.meshletCount, meshletCenter);
+        }
+        return *it;
+    }
+
+    // adds the faces of the visible meshlets as runs in draw order, so culling never reorders the triangles.
+    // front to back, the meshlets are added in the model's ClusterOrder instead
+    void cullMeshlets(const ModelPtr& model, const Frustum& frustum, const glm::mat4& transform, int instanceID,
+                      int firstFace, int primCount, PipelineStats& st)
+    {
+        // the eye is the point projecting to x = y = w = 0, at infinity for orthographic projections
+        vec4 eye = glm::inverse(_viewProj * transform) * vec4(0, 0, 1, 0);
+        const bool cones = std::abs(eye.w) > 1e-12f && glm::determinant(glm::mat3(transform)) > 0;
+        const vec3 eyePos = cones ? vec3(eye) / eye.w : vec3(0);
+
+        const ClusterOrder* order = nullptr;
+        if (_frontToBack) order = &clusterOrder(model, glm::normalize(vec3(depthPlane(_viewProj * transform))), st);
+
+        const auto& faces = model->meshletFaces();
+        const auto& meshlets = model->meshlets();
+        if (!order) _faceVisible.assign(primCount, 0);
+        auto testMeshlet = [&](int index) {
+            const Meshlet& m = meshlets[order ? order->meshlets[index] : index];
+            st.meshletsTested++;
+            if (!visible(frustum, m.sphere, m.bounds) || (cones && m.backfacing(eyePos))) {
+                st.meshletsCulled++;
+                return;
+            }
+            for (uint32_t i = m.first; i < m.first + m.count; i++) {
+                int f = (int)faces[i] - firstFace;
+                if (f < 0 || f >= primCount) continue;
+                if (order) {
+                    addRun(instanceID, f, 1);
+                }
+                else {
+                    _faceVisible[f] = 1;
+                }
+            }
+        };
+
+        if (model->clusters().empty()) {
+            for (int i = 0; i < (int)meshlets.size(); i++) {
+                testMeshlet(i);
+            }
+        }
+        for (size_t k = 0; k < model->clusters().size(); k++) {
+            const CullCluster& c = model->clusters()[order ? order->clusters[k] : k];
+            bool culled = !visible(frustum, c.sphere, c.bounds);
+            bool occluded = !culled && _occlusion && _occlusion->occluded(c.bounds, _viewProj * transform);
+            if (culled || occluded) {
+                (culled ? st.clustersCulled : st.clustersOccluded)++;
+                st.meshletsTested += c.meshletCount;
+                st.meshletsCulled += c.meshletCount;
+                continue;
+            }
+            for (int i = c.firstMeshlet; i < c.firstMeshlet + c.meshletCount; i++) {
+                testMeshlet(i);
+            }
+        }
+        if (order) return;
+
+        for (int f = 0; f < primCount;) {
+            if (!_faceVisible[f]) {
+                f++;
+                continue;
+            }
+            int end = f;
+            while (end < primCount && _faceVisible[end]) {
+                end++;
+            }
+            addRun(instanceID, f, end - f);
+            f = end;
+        }
+    }
+
+    static void bindInstance(Shader& shader, const InstanceBuffer& instances, int instanceID)
+    {
+        shader._instanceID = instanceID;
+        shader._instanceTransform = instanceTransform(instances, instanceID);
+    }
+
+    void resizeHeatmap()
+    {
+        size_t size = _frame->width() * _frame->height();
+        if (_heatmap.size() == size) return;
+        finish();
+        _heatmap.assign(size, HeatmapTexel{});
+    }
+
+    void resizeGBuffer()
+    {
+        size_t size = _frame->width() * _frame->height();
+        if (_gbuffer.size() == size) return;
+        finish();
+        _gbuffer.resize(size);
+    }
+
+    void resizeSamples()
+    {
+        const int width = _frame->width(), height = _frame->height();
+        size_t size = (size_t)width * height * _samples;
+        if (_sampleDepth.size() == size) return;
+        finish();
+        _sampleDepth.assign(size, std::numeric_limits<double>::max());
+        _sampleColors.resize(size);
+        _sampleBlocksX = (width + SampleBlock - 1) / SampleBlock;
+        _sampleBlocks.assign(_sampleBlocksX * ((height + SampleBlock - 1) / SampleBlock), 1);
+    }
+
+    void resizeVisibility()
+    {
+        size_t size = _frame->width() * _frame->height();
+        if (_visibility.size() == size) return;
+        finish();
+        _visibility.assign(size, EmptyVisibility);
+    }
+
+    void clearTargets()
+    {
+        std::fill(_zbuffer.begin(), _zbuffer.end(), std::numeric_limits<double>::max());
+        _frame->clear();
+        resetStats();
+        std::fill(_heatmap.begin(), _heatmap.end(), HeatmapTexel{});
+        std::fill(_visibility.begin(), _visibility.end(), EmptyVisibility);
+        std::fill(_gbuffer.written.begin(), _gbuffer.written.end(), 0);
+        std::fill(_sampleDepth.begin(), _sampleDepth.end(), std::numeric_limits<double>::max());
+        std::fill(_sampleBlocks.begin(), _sampleBlocks.end(), 1);
+    }
+
+    // the shader is copied so the resolve sees the uniforms of this draw, drawIDs of the instances follow
+    // those of the previous draws
+    void addVisibilityDraw(PrimitiveType mode, int start, int instanceCount, bool indexed)
+    {
+        if (_depthPass != DepthPass::Visibility || mode != PrimitiveType::Triangle) return;
+        uint32_t firstID =
+            _visibilityDraws.empty() ? 0 : _visibilityDraws.back().firstID + _visibilityDraws.back().instanceCount;
+        ShaderPtr shader = _shader->clone();
+        _visibilityDraws.push_back({ firstID, (uint32_t)instanceCount, _model, shader ? shader : _shader, !!shader,
+                                     _drawInstances, _viewport, start, indexed });
+    }
+
+    // back end steps run one after another in submission order on the pool
+    void enqueueBackEnd(std::function<void()> work)
+    {
+        std::packaged_task<void()> task(std::move(work));
+        _backEndDone = task.get_future().share();
+
+        std::lock_guard<std::mutex> lock(_backEndMutex);
+        _backEndQueue.push_back(std::move(task));
+        if (_backEndRunning) return;
+        _backEndRunning = true;
+        ThreadPool::global().submit([this] { drainBackEnd(); });
+    }
+
+    void drainBackEnd()
+    {
+        while (true) {
+            std::packaged_task<void()> task;
+            {
+                std::lock_guard<std::mutex> lock(_backEndMutex);
+                if (_backEndQueue.empty()) {
+                    _backEndRunning = false;
+                    _backEndIdle.notify_all();
+                    return;
+                }
+                task = std::move(_backEndQueue.front());
+                _backEndQueue.pop_front();
+            }
+            task();
+        }
+    }
+
+    // fetch maps the i-th vertex of the draw to a model vertex, only the primitives in _runs are drawn
+    template <class Fetch>
+    void draw(PrimitiveType mode, Fetch fetch)
+    {
+        JRENDER_TRACE_SCOPE("Render::draw");
+        if (_heatmapEnabled) resizeHeatmap();
+        if (_deferred) resizeGBuffer();
+
+        switch (_depthPass) {
+        case DepthPass::Visibility:
+            resizeVisibility();
+            drawDebug<PassVisibility>(mode, fetch);
+            break;
+        case DepthPass::DepthOnly:
+            drawDebug<PassDepthOnly>(mode, fetch);
+            break;
+        case DepthPass::DepthEqual:
+            drawDebug<PassDepthEqual>(mode, fetch);
+            break;
+        default:
+            if (_samples > 1 && !_deferred) {
+                resizeSamples();
+                drawDebug<PassMsaa>(mode, fetch);
+            }
+            else {
+                drawDebug<0>(mode, fetch);
+            }
+            break;
+        }
+    }
+
+    template <unsigned Pass, class Fetch>
+    void drawDebug(PrimitiveType mode, Fetch fetch)
+    {
+        switch ((_statsEnabled ? DebugStats : 0u) | (_heatmapEnabled ? DebugHeatmap : 0u)) {
+        case 0:
+            drawPrimitives<Pass>(mode, fetch);
+            break;
+        case DebugStats:
+            drawPrimitives<Pass | DebugStats>(mode, fetch);
+            break;
+        case DebugHeatmap:
+            drawPrimitives<Pass | DebugHeatmap>(mode, fetch);
+            break;
+        default:
+            drawPrimitives<Pass | DebugStats | DebugHeatmap>(mode, fetch);
+            break;
+        }
+    }
+
+    template <unsigned Features, class Fetch>
+    void drawPrimitives(PrimitiveType mode, Fetch fetch)
+    {
+        if constexpr (Features & (PassDepthOnly | PassVisibility)) {
+            if (mode != PrimitiveType::Triangle) return;
+        }
+
+        if (mode == PrimitiveType::Triangle) {
+            DrawSlot& slot = _slots[_slot];
+            if (slot.done.valid()) ThreadPool::global().wait(slot.done);
+            slot.model = _model;
+            slot.viewport = _viewport;
+            slot.instances = _drawInstances;
+            slot.drawID = _visibilityDraws.empty() ? 0 : _visibilityDraws.back().firstID;
+            slot.shadingRate = _shadingRate;
+            if (cloneWorkerShaders(slot)) {
+                drawTrianglesBinned<Features>(slot, fetch);
+                return;
+            }
+
+            // the immediate paths below draw straight into the frame
+            finish();
+            for (const auto& run : _runs) {
+                for (int i = run.first; i < run.first + run.count; i++) {
+                    int vert[3] = { fetch(i * 3), fetch(i * 3 + 1), fetch(i * 3 + 2) };
+                    drawTriangle<Features>(slot, i, run.instanceID, vert);
+                }
+            }
+        }
+        else if (mode == PrimitiveType::Line) {
+            finish();
+            for (const auto& run : _runs) {
+                for (int i = run.first; i < run.first + run.count; i++) {
+                    int vert[2] = { fetch(i * 2), fetch(i * 2 + 1) };
+                    drawLine<Features>(i, run.instanceID, vert);
+                }
+            }
+        }
+        else if (mode == PrimitiveType::Point) {
+            finish();
+            for (const auto& run : _runs) {
+                for (int i = run.first; i < run.first + run.count; i++) {
+                    drawPoint<Features>(i, run.instanceID, fetch(i));
+                }
+            }
+        }
+    }
+
+    // false if the shader can't be copied
+    bool cloneWorkerShaders(DrawSlot& slot)
+    {
+        slot.shaders.resize(ThreadPool::global().threadCount() + 1);
+        for (auto& shader : slot.shaders) {
+            shader = _shader->clone();
+            if (!shader) return false;
+        }
+        return true;
+    }
+
+    // sort middle: batches of triangles are shaded and binned to tiles in parallel, then every tile rasterizes
+    // its triangles in submission order on its worker's shader copy. tiles never share pixels, the result matches
+    // drawing the triangles one after another. pipelined, the tile pass is queued and the draw returns
+    template <unsigned Features, class Fetch>
+    void drawTrianglesBinned(DrawSlot& slot, Fetch fetch)
+    {
+        ThreadPool& pool = ThreadPool::global();
+        const int triCount = runPrimitives();
+        const int tilesX = (_frame->width() + TileSize - 1) / TileSize;
+        const int tilesY = (_frame->height() + TileSize - 1) / TileSize;
+        const int batchCount = (triCount + BatchSize - 1) / BatchSize;
+        if ((int)slot.batches.size() < batchCount) slot.batches.resize(batchCount);
+
+        pool.parallelFor(0, batchCount, 1, [&](int b0, int b1) {
+            Shader& shader = *slot.shaders[pool.workerIndex()];
+            for (int b = b0; b < b1; b++) {
+                setupBatch<Features>(shader, slot, slot.batches[b], b * BatchSize,
+                                     std::min(triCount, (b + 1) * BatchSize), tilesX, tilesY, fetch);
+            }
+        });
+
+        auto backEnd = [this, &slot, tilesX, tilesY, batchCount] {
+            JRENDER_TRACE_SCOPE("back end");
+            ThreadPool::global().parallelFor(0, tilesX * tilesY, 1, [&](int t0, int t1) {
+                for (int t = t0; t < t1; t++) {
+                    rasterTile<Features>(slot, t, tilesX, batchCount);
+                }
+            });
+        };
+        if (_incremental) {
+            retainDraw<Features>(slot, tilesX, batchCount);
+            return;
+        }
+        if (!_pipelined) {
+            backEnd();
+            return;
+        }
 
-    Image _diffuseMap;   // diffuse color texture
-    Image _specularMap;  // specular map texture
-    Image _normalMap;    // normal map texture
+        enqueueBackEnd(backEnd);
+        slot.done = _backEndDone;
+        _slot ^= 1;
+    }
 
-    std::array<ImagePtr, 10> _textures;
-};
-using ModelPtr = std::shared_ptr<Model>;
+    template <unsigned Features, class Fetch>
+    void setupBatch(Shader& shader, const DrawSlot& slot, Batch& batch, int begin, int end, int tilesX, int tilesY,
+                    Fetch fetch)
+    {
+        JRENDER_TRACE_SCOPE("vertex batch");
+        batch.tris.clear();
+        batch.bins.resize(tilesX * tilesY);
+        for (auto& bin : batch.bins) {
+            bin.clear();
+        }
 
-vec3 barycentricLine(const vec2 tri[2], const vec2 p)
-{
-    double a = glm::distance(p, tri[0]) / glm::distance(tri[0], tri[1]);
-    return vec3{ 1 - a, a, 0 };
-}
+        auto run = std::upper_bound(_runs.begin(), _runs.end(), begin,
+                                    [](int t, const DrawRun& r) { return t < r.offset; }) - 1;
+        for (int t = begin; t < end; t++) {
+            if (t == run->offset + run->count) ++run;
+            int instanceID = run->instanceID, i = run->first + t - run->offset;
+            int vert[3] = { fetch(i * 3), fetch(i * 3 + 1), fetch(i * 3 + 2) };
+            TriangleSetup tri;
+            if (!setupTriangle<Features>(shader, slot, i, instanceID, vert, tri)) continue;
+
+            uint32_t index = batch.tris.size();
+            batch.tris.push_back(tri);
+            for (int ty = tri.minY / TileSize; ty <= tri.maxY / TileSize; ty++) {
+                for (int tx = tri.minX / TileSize; tx <= tri.maxX / TileSize; tx++) {
+                    batch.bins[ty * tilesX + tx].push_back(index);
+                }
+            }
+        }
+    }
 
-vec3 barycentric(const vec2 tri[3], const vec2& P)
-{
-    glm::mat3 ABC = { vec3(tri[0], 1.0), vec3(tri[1], 1.0), vec3(tri[2], 1.0) };
+    template <unsigned Features>
+    void rasterTile(const DrawSlot& slot, int tile, int tilesX, int batchCount)
+    {
+        constexpr bool Stats = Features & DebugStats;
+        JRENDER_TRACE_SCOPE("raster tile");
+
+        Shader& shader = *slot.shaders[ThreadPool::global().workerIndex()];
+        const int x0 = (tile % tilesX) * TileSize, y0 = (tile / tilesX) * TileSize;
+        const int x1 = std::min(x0 + TileSize, _frame->width()) - 1, y1 = std::min(y0 + TileSize, _frame->height()) - 1;
+
+        for (int b = 0; b < batchCount; b++) {
+            const Batch& batch = slot.batches[b];
+            for (uint32_t index : batch.bins[tile]) {
+                const TriangleSetup& tri = batch.tris[index];
+
+                // the varyings live in the shader copy that ran the front end, run vs again on this one. depth
+                // and ids only need the setup
+                if constexpr (!(Features & (PassDepthOnly | PassVisibility))) {
+                    [[maybe_unused]] Clock::time_point t0;
+                    if constexpr (Stats) t0 = Clock::now();
+                    vec4 pV[3];
+                    shadeVertices(shader, slot, tri.primID, tri.instanceID, tri.vert, pV);
+                    if constexpr (Stats) {
+                        PipelineStats& st = threadStats();
+                        st.verticesShaded += 3;
+                        st.vertexNs += elapsedNs(t0);
+                    }
+                }
 
-    // for a degenerate triangle generate negative coordinates, it will be thrown away by the rasterizator
-    if (glm::determinant(ABC) < 1e-3) return { -1, 1, 1 };
+                rasterTriangle<Features>(shader, slot, tri, std::max(tri.minX, x0), std::min(tri.maxX, x1),
+                                         std::max(tri.minY, y0), std::min(tri.maxY, y1));
+            }
+        }
+    }
 
-    return glm::inverse(ABC) * vec3(P, 1.0);
-}
+    static uint64_t hashMix(uint64_t h, uint64_t v)
+    {
+        h = (h ^ v) * 0x9e3779b97f4a7c15ull;
+        return h ^ (h >> 32);
+    }
 
-class Render
-{
-public:
-    Render(ImagePtr frame, ModelPtr model, ShaderPtr shader)
-      : _frame(std::move(frame))
-      , _model(std::move(model))
-      , _shader(std::move(shader))
-      , _zbuffer(_frame->width() * _frame->height(), std::numeric_limits<double>::max())
-    {}
+    static Rect unite(const Rect& a, const Rect& b)
+    {
+        if (a.empty()) return b;
+        if (b.empty()) return a;
+        int x = std::min(a.x, b.x), y = std::min(a.y, b.y);
+        return { x, y, std::max(a.x + a.width, b.x + b.width) - x, std::max(a.y + a.height, b.y + b.height) - y };
+    }
 
-    ~Render() {}
+    static DrawDamage batchDamage(const Batch& batch)
+    {
+        static_assert(sizeof(TriangleSetup) % sizeof(uint32_t) == 0);
+        DrawDamage ret;
+        for (const TriangleSetup& tri : batch.tris) {
+            uint32_t words[sizeof(TriangleSetup) / sizeof(uint32_t)];
+            std::memcpy(words, &tri, sizeof(tri));
+            for (uint32_t w : words) {
+                ret.hash = hashMix(ret.hash, w);
+            }
+            ret.bounds = unite(ret.bounds, { tri.minX, tri.minY, tri.maxX - tri.minX + 1, tri.maxY - tri.minY + 1 });
+        }
+        return ret;
+    }
 
-    void setViewport(int x, int y, int w, int h)
+    // keeps the front end output of an incremental draw for endFrame(), the slot trades places with a recycled one
+    template <unsigned Features>
+    void retainDraw(DrawSlot& slot, int tilesX, int batchCount)
     {
-        _viewport = glm::mat4(1.0f);
+        std::vector<DrawDamage> batches(batchCount);
+        ThreadPool::global().parallelFor(0, batchCount, 1, [&](int b0, int b1) {
+            for (int b = b0; b < b1; b++) {
+                batches[b] = batchDamage(slot.batches[b]);
+            }
+        });
+
+        RetainedDraw& d = _retained.emplace_back();
+        d.damage.hash = hashMix(hashMix(Features | (_deferred ? 1u << 31 : 0u), (uintptr_t)_model.get()),
+                                (uintptr_t)_shader.get());
+        for (const DrawDamage& b : batches) {
+            d.damage.hash = hashMix(d.damage.hash, b.hash);
+            d.damage.bounds = unite(d.damage.bounds, b.bounds);
+        }
 
-        // 缩放 NDC 到窗口坐标的比例
-        _viewport[0][0] = w / 2.0f;
-        _viewport[1][1] = h / 2.0f;
-        _viewport[2][2] = 1;
+        if (_slotPool.empty()) {
+            d.slot = std::make_unique<DrawSlot>();
+        }
+        else {
+            d.slot = std::move(_slotPool.back());
+            _slotPool.pop_back();
+        }
+        std::swap(*d.slot, slot);
+        d.raster = [this, kept = d.slot.get(), tilesX, batchCount](int tile) {
+            rasterTile<Features>(*kept, tile, tilesX, batchCount);
+        };
+    }
 
-        // 平移到窗口坐标的偏移量
-        _viewport[3][0] = x + w / 2.0f;
-        _viewport[3][1] = y + h / 2.0f;
-        _viewport[3][2] = 0;
+    void recycleRetained()
+    {
+        for (auto& d : _retained) {
+            d.slot->model.reset();
+            d.slot->instances.reset();
+            d.slot->shaders.clear();
+            _slotPool.push_back(std::move(d.slot));
+        }
+        _retained.clear();
     }
 
-    void setModel(ModelPtr model) { _model = std::move(model); }
-    void setShader(ShaderPtr shader) { _shader = std::move(shader); }
+    // clears one tile of every target and rasterizes the kept draws touching it again in submission order
+    void redrawTile(int tile, int tilesX)
+    {
+        JRENDER_TRACE_SCOPE("redraw tile");
+        const int width = _frame->width();
+        const int x0 = (tile % tilesX) * TileSize, y0 = (tile / tilesX) * TileSize;
+        const int x1 = std::min(x0 + TileSize, width), y1 = std::min(y0 + TileSize, _frame->height());
+
+        _frame->clear(x0, y0, x1 - x0, y1 - y0);
+        for (int y = y0; y < y1; y++) {
+            size_t row = (size_t)y * width;
+            std::fill(_zbuffer.begin() + row + x0, _zbuffer.begin() + row + x1, std::numeric_limits<double>::max());
+            if (!_heatmap.empty()) std::fill(_heatmap.begin() + row + x0, _heatmap.begin() + row + x1, HeatmapTexel{});
+            if (!_visibility.empty()) {
+                std::fill(_visibility.begin() + row + x0, _visibility.begin() + row + x1, EmptyVisibility);
+            }
+            if (_gbuffer.size()) std::fill(_gbuffer.written.begin() + row + x0, _gbuffer.written.begin() + row + x1, 0);
+            if (!_sampleDepth.empty()) {
+                std::fill(_sampleDepth.begin() + (row + x0) * _samples, _sampleDepth.begin() + (row + x1) * _samples,
+                          std::numeric_limits<double>::max());
+            }
+        }
+        if (!_sampleBlocks.empty()) {
+            for (int by = y0 / SampleBlock; by <= (y1 - 1) / SampleBlock; by++) {
+                std::fill_n(_sampleBlocks.begin() + by * _sampleBlocksX + x0 / SampleBlock,
+                            (x1 - x0 + SampleBlock - 1) / SampleBlock, 1);
+            }
+        }
 
-    const std::vector<double>& zbuffer() const { return _zbuffer; }
+        for (const auto& d : _retained) {
+            const Rect& b = d.damage.bounds;
+            if (b.x >= x1 || b.y >= y1 || b.x + b.width <= x0 || b.y + b.height <= y0) continue;
+            d.raster(tile);
+        }
+    }
 
-    void drawArray(PrimitiveType mode, int start, int vertexCount)
+    // runs of damaged tiles per tile row, a run grows the rectangle above it when both span the same columns
+    std::vector<Rect> damagedRects(int tilesX, int tilesY) const
     {
-        if (mode == PrimitiveType::Triangle) {
-            int priCount = vertexCount / 3;
-            for (int i = 0; i < priCount; i++) {
-                int vert[3] = { start + i * 3, start + i * 3 + 1, start + i * 3 + 2 };
-                drawTriangle(i, vert);
+        const int width = _frame->width(), height = _frame->height();
+        std::vector<Rect> rects;
+        std::vector<size_t> open, next;  // rectangles reaching down to the previous and the current tile row
+        for (int ty = 0; ty < tilesY; ty++) {
+            next.clear();
+            for (int tx = 0; tx < tilesX; tx++) {
+                if (!_damagedTiles[ty * tilesX + tx]) continue;
+                int end = tx + 1;
+                while (end < tilesX && _damagedTiles[ty * tilesX + end]) {
+                    end++;
+                }
+                Rect r{ tx * TileSize, ty * TileSize, std::min(end * TileSize, width) - tx * TileSize,
+                        std::min((ty + 1) * TileSize, height) - ty * TileSize };
+                auto above = std::find_if(open.begin(), open.end(), [&](size_t i) {
+                    return rects[i].x == r.x && rects[i].width == r.width;
+                });
+                if (above != open.end()) {
+                    rects[*above].height += r.height;
+                    next.push_back(*above);
+                }
+                else {
+                    next.push_back(rects.size());
+                    rects.push_back(r);
+                }
+                tx = end;
             }
+            std::swap(open, next);
         }
-        else if (mode == PrimitiveType::Line) {
-            int priCount = vertexCount / 2;
-            for (int i = 0; i < priCount; i++) {
-                int vert[2] = { start + i * 2, start + i * 2 + 1 };
-                drawLine(i, vert);
+        return rects;
+    }
+
+    void shadeVertices(Shader& shader, const DrawSlot& slot, int primID, int instanceID, const int vert[3],
+                       vec4 pV[3])
+    {
+        shader._primType = PrimitiveType::Triangle;
+        shader._primID = primID;
+        bindInstance(shader, slot.instances, instanceID);
+        for (int i = 0; i < 3; i++) {
+            shader._vertexID = i;
+            pV[i] = slot.viewport * shader.vs(slot.model->vertex(vert[i]));
+        }
+    }
+
+    // screen positions to 1/256 pixel, false for positions so far off screen that the edge products could overflow
+    static bool snap(const vec2 pts[3], int64_t fx[3], int64_t fy[3])
+    {
+        constexpr float limit = 1 << 21;
+        for (int i = 0; i < 3; i++) {
+            if (!(std::abs(pts[i].x) < limit && std::abs(pts[i].y) < limit)) return false;
+            fx[i] = std::llround(pts[i].x * (1 << SubpixelBits));
+            fy[i] = std::llround(pts[i].y * (1 << SubpixelBits));
+        }
+        return true;
+    }
+
+    // integer edge functions of the snapped triangle, false when it is back facing or has no area. top-left fill
+    // rule: a pixel center exactly on an edge belongs to the triangle only for left edges, the ones the inside
+    // lies right of, and for horizontal edges with the inside above them in rows, so a center on an edge shared by
+    // two triangles is covered by exactly one of them
+    static bool setupEdges(const int64_t fx[3], const int64_t fy[3], TriangleSetup& tri)
+    {
+        int64_t area = (fx[1] - fx[0]) * (fy[2] - fy[0]) - (fx[2] - fx[0]) * (fy[1] - fy[0]);
+        if (area <= 0) return false;
+
+        constexpr int64_t half = 1 << (SubpixelBits - 1);
+        for (int i = 0; i < 3; i++) {
+            int a = (i + 1) % 3, b = (i + 2) % 3;
+            int64_t dx = fx[b] - fx[a], dy = fy[b] - fy[a];
+            bool topLeft = dy < 0 || (dy == 0 && dx > 0);
+            tri.edge[i] = dx * (half - fy[a]) - dy * (half - fx[a]) - (topLeft ? 0 : 1);
+            tri.stepX[i] = -dy << SubpixelBits;
+            tri.stepY[i] = dx << SubpixelBits;
+        }
+        tri.invArea = 1.0 / area;
+        return true;
+    }
+
+    // vertex stage and triangle setup, false if the triangle is outside the frame, back facing or degenerate
+    template <unsigned Features>
+    bool setupTriangle(Shader& shader, const DrawSlot& slot, int primID, int instanceID, const int vert[3],
+                       TriangleSetup& tri)
+    {
+        constexpr bool Stats = Features & DebugStats;
+        [[maybe_unused]] Clock::time_point t0;
+        if constexpr (Stats) t0 = Clock::now();
+
+        vec4 pV[3];
+        shadeVertices(shader, slot, primID, instanceID, vert, pV);
+        vec2 pts[3] = { vec2(pV[0] / pV[0][3]), vec2(pV[1] / pV[1][3]), vec2(pV[2] / pV[2][3]) };
+
+        [[maybe_unused]] Clock::time_point t1;
+        if constexpr (Stats) {
+            PipelineStats& st = threadStats();
+            st.verticesShaded += 3;
+            st.primitivesSubmitted++;
+            t1 = Clock::now();
+            st.vertexNs += std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count();
+        }
+
+        int64_t fx[3], fy[3];
+        if (!snap(pts, fx, fy)) {
+            if constexpr (Stats) threadStats().primitivesClipped++;
+            return false;
+        }
+
+        // the pixels whose centers lie inside the snapped bounds, or any of whose samples do in the multisampled pass
+        constexpr int64_t half = 1 << (SubpixelBits - 1), one = 1 << SubpixelBits;
+        int64_t reach = 0;
+        if constexpr (Features & PassMsaa) reach = sampleReach(_samples) * (one / 16);
+        auto firstCenter = [reach](int64_t v) { return (v - half - reach + one - 1) >> SubpixelBits; };
+        auto lastCenter = [reach](int64_t v) { return (v - half + reach) >> SubpixelBits; };
+        tri.minX = std::max<int64_t>(firstCenter(std::min({ fx[0], fx[1], fx[2] })), 0);
+        tri.maxX = std::min<int64_t>(lastCenter(std::max({ fx[0], fx[1], fx[2] })), _frame->width() - 1);
+        tri.minY = std::max<int64_t>(firstCenter(std::min({ fy[0], fy[1], fy[2] })), 0);
+        tri.maxY = std::min<int64_t>(lastCenter(std::max({ fy[0], fy[1], fy[2] })), _frame->height() - 1);
+        if (tri.minX > tri.maxX || tri.minY > tri.maxY) {
+            if constexpr (Stats) threadStats().primitivesClipped++;
+            return false;
+        }
+
+        // back facing and zero area triangles cover no pixel center
+        if (!setupEdges(fx, fy, tri)) {
+            if constexpr (Stats) threadStats().primitivesCulled++;
+            return false;
+        }
+
+        tri.depth = vec3(pV[0].z, pV[1].z, pV[2].z);
+        std::copy(vert, vert + 3, tri.vert);
+        tri.primID = primID;
+        tri.instanceID = instanceID;
+
+        if constexpr (Stats) threadStats().setupNs += elapsedNs(t1);
+        return true;
+    }
+
+    // covers [x0, x1] x [y0, y1] of the triangle, shader must hold the triangle's varyings unless only depth is drawn
+    template <unsigned Features>
+    void rasterTriangle(Shader& shader, const DrawSlot& slot, const TriangleSetup& tri, int x0, int x1, int y0,
+                        int y1)
+    {
+        constexpr bool Stats = Features & DebugStats;
+        constexpr bool Heatmap = Features & DebugHeatmap;
+        if constexpr (Features & PassMsaa) {
+            rasterSamples<Features>(shader, tri, x0, x1, y0, y1);
+            return;
+        }
+        if constexpr (!(Features & (PassDepthOnly | PassVisibility))) {
+            if (slot.shadingRate != ShadingRate::Rate1x1 || !_tileRates.empty()) {
+                rasterCoarse<Features>(shader, slot, tri, x0, x1, y0, y1);
+                return;
             }
         }
-        else if (mode == PrimitiveType::Point) {
-            for (int i = 0; i < vertexCount; i++) {
-                int vert = start + i;
-                drawPoint(i, vert);
+
+        PipelineStats* st = nullptr;
+        uint64_t fsNs = 0;
+        [[maybe_unused]] Clock::time_point rasterStart;
+        if constexpr (Stats) {
+            st = &threadStats();
+            rasterStart = Clock::now();
+        }
+
+        const int width = _frame->width();
+        // depth test and write of a pixel whose center the triangle covers
+        auto covered = [&](int x, int y, const int64_t w[3]) {
+            if constexpr (Stats) st->pixelsCovered++;
+
+            vec3 bc_screen = tri.barycentric(w);
+            double depth = glm::dot(tri.depth, bc_screen);
+            if constexpr (Heatmap) _heatmap[y * width + x].depthTests++;
+            bool failed =
+                Features & PassDepthEqual ? depth != _zbuffer[y * width + x] : depth > _zbuffer[y * width + x];
+            if (failed) {
+                if constexpr (Stats) st->depthTestsFailed++;
+                return;
+            }
+            if constexpr (Stats) st->depthTestsPassed++;
+            if constexpr (Heatmap) _heatmap[y * width + x].depthPasses++;
+
+            if constexpr (Features & PassDepthOnly) {
+                _zbuffer[y * width + x] = depth;
+            }
+            else if constexpr (Features & PassVisibility) {
+                _zbuffer[y * width + x] = depth;
+                _visibility[y * width + x] = (uint64_t)(slot.drawID + tri.instanceID) << 32 | (uint32_t)tri.primID;
+            }
+            else if (shadePixel<Features>(shader, st, x, y, bc_screen, fsNs)) {
+                if constexpr (!(Features & PassDepthEqual)) _zbuffer[y * width + x] = depth;
+            }
+        };
+
+        // blocks aligned to the screen are classified by the corners where each edge function is smallest and
+        // largest: outside one edge the block is skipped, inside all three its pixels skip the coverage test
+        for (int by = y0 & ~(CoverageBlock - 1); by <= y1; by += CoverageBlock) {
+            const int by0 = std::max(by, y0), by1 = std::min(by + CoverageBlock - 1, y1);
+            for (int bx = x0 & ~(CoverageBlock - 1); bx <= x1; bx += CoverageBlock) {
+                const int bx0 = std::max(bx, x0), bx1 = std::min(bx + CoverageBlock - 1, x1);
+                int64_t row[3];
+                tri.edgesAt(bx0, by0, row);
+                bool outside = false, inside = true;
+                for (int i = 0; i < 3; i++) {
+                    int64_t dx = tri.stepX[i] * (bx1 - bx0), dy = tri.stepY[i] * (by1 - by0);
+                    outside |= row[i] + std::max<int64_t>(dx, 0) + std::max<int64_t>(dy, 0) < 0;
+                    inside &= row[i] + std::min<int64_t>(dx, 0) + std::min<int64_t>(dy, 0) >= 0;
+                }
+                if (outside) {
+                    if constexpr (Stats) st->blocksRejected++;
+                    continue;
+                }
+                if constexpr (Stats) st->blocksAccepted += inside;
+
+                for (int y = by0; y <= by1; y++) {
+                    int64_t w[3] = { row[0], row[1], row[2] };
+                    for (int x = bx0; x <= bx1; x++) {
+                        if (inside || TriangleSetup::inside(w)) covered(x, y, w);
+                        for (int i = 0; i < 3; i++) {
+                            w[i] += tri.stepX[i];
+                        }
+                    }
+                    for (int i = 0; i < 3; i++) {
+                        row[i] += tri.stepY[i];
+                    }
+                }
             }
         }
+
+        if constexpr (Stats) {
+            st->fragmentNs += fsNs;
+            st->rasterNs += elapsedNs(rasterStart) - fsNs;
+        }
     }
 
-    void drawIndex(PrimitiveType mode, int start, int indexCount)
+    template <unsigned Features>
+    void resolveTiles()
     {
-        if (mode == PrimitiveType::Triangle) {
-            int priCount = indexCount / 3;
-            for (int i = 0; i < priCount; i++) {
-                int vert[3] = { _model->vertexIndex(start + i * 3), _model->vertexIndex(start + i * 3 + 1),
-                                _model->vertexIndex(start + i * 3 + 2) };
-                drawTriangle(i, vert);
+        ThreadPool& pool = ThreadPool::global();
+        const int tilesX = (_frame->width() + TileSize - 1) / TileSize;
+        const int tilesY = (_frame->height() + TileSize - 1) / TileSize;
+        const bool parallel = std::all_of(_visibilityDraws.begin(), _visibilityDraws.end(),
+                                          [](const VisibilityDraw& d) { return d.copied; });
+
+        // per worker copies of the draws' shaders, made on first use
+        std::vector<std::vector<ShaderPtr>> shaders(pool.threadCount() + 1,
+                                                    std::vector<ShaderPtr>(_visibilityDraws.size()));
+        auto resolve = [&](int t0, int t1) {
+            std::vector<ShaderPtr>& workerShaders = shaders[parallel ? pool.workerIndex() : 0];
+            for (int t = t0; t < t1; t++) {
+                resolveTile<Features>(t, tilesX, workerShaders, parallel);
             }
+        };
+        if (parallel) {
+            pool.parallelFor(0, tilesX * tilesY, 1, resolve);
         }
-        else if (mode == PrimitiveType::Line) {
-            int priCount = indexCount / 2;
-            for (int i = 0; i < priCount; i++) {
-                int vert[2] = { _model->vertexIndex(start + i * 2), _model->vertexIndex(start + i * 2 + 1) };
-                drawLine(i, vert);
+        else {
+            resolve(0, tilesX * tilesY);
+        }
+    }
+
+    // pixels in a row mostly belong to the triangle of the previous pixel, its vertices are shaded again only
+    // when the id changes
+    template <unsigned Features>
+    void resolveTile(int tile, int tilesX, std::vector<ShaderPtr>& shaders, bool copy)
+    {
+        constexpr bool Stats = Features & DebugStats;
+        JRENDER_TRACE_SCOPE("resolve tile");
+
+        const int width = _frame->width();
+        const int x0 = (tile % tilesX) * TileSize, y0 = (tile / tilesX) * TileSize;
+        const int x1 = std::min(x0 + TileSize, width) - 1, y1 = std::min(y0 + TileSize, _frame->height()) - 1;
+
+        PipelineStats* st = Stats ? &threadStats() : nullptr;
+        uint64_t fsNs = 0;
+        uint64_t current = EmptyVisibility;
+        Shader* shader = nullptr;
+        TriangleSetup tri{};
+        for (int y = y0; y <= y1; y++) {
+            for (int x = x0; x <= x1; x++) {
+                uint64_t id = _visibility[y * width + x];
+                if (id == EmptyVisibility) continue;
+                if (id != current) {
+                    current = id;
+                    uint32_t drawID = id >> 32;
+                    auto draw = std::prev(std::upper_bound(
+                        _visibilityDraws.begin(), _visibilityDraws.end(), drawID,
+                        [](uint32_t i, const VisibilityDraw& d) { return i < d.firstID; }));
+                    ShaderPtr& s = shaders[draw - _visibilityDraws.begin()];
+                    if (!s) s = copy ? draw->shader->clone() : draw->shader;
+                    shader = s.get();
+
+                    [[maybe_unused]] Clock::time_point t0;
+                    if constexpr (Stats) t0 = Clock::now();
+                    resolveTriangle(*shader, *draw, drawID - draw->firstID, (uint32_t)id, tri);
+                    if constexpr (Stats) {
+                        st->verticesShaded += 3;
+                        st->vertexNs += elapsedNs(t0);
+                    }
+                }
+                int64_t w[3];
+                tri.edgesAt(x, y, w);
+                shadePixel<Features>(*shader, st, x, y, tri.barycentric(w), fsNs);
             }
         }
-        else if (mode == PrimitiveType::Point) {
-            for (int i = 0; i < indexCount; i++) {
-                int vert = _model->vertexIndex(start + i);
-                drawPoint(i, vert);
+        if constexpr (Stats) st->fragmentNs += fsNs;
+    }
+
+    // runs vs on the triangle the way setupTriangle() did and rebuilds the same edge functions
+    void resolveTriangle(Shader& shader, const VisibilityDraw& draw, int instanceID, int primID, TriangleSetup& tri)
+    {
+        shader._primType = PrimitiveType::Triangle;
+        shader._primID = primID;
+        bindInstance(shader, draw.instances, instanceID);
+        vec2 pts[3];
+        for (int i = 0; i < 3; i++) {
+            shader._vertexID = i;
+            int index = draw.start + primID * 3 + i;
+            int vert = draw.indexed ? draw.model->vertexIndex(index) : index;
+            vec4 pV = draw.viewport * shader.vs(draw.model->vertex(vert));
+            pts[i] = vec2(pV / pV[3]);
+        }
+        // the triangle passed both when it was rasterized, the pixels that hold its id are inside it
+        int64_t fx[3], fy[3];
+        snap(pts, fx, fy);
+        setupEdges(fx, fy, tri);
+    }
+
+    // runs fs and writes the pixel unless it is discarded, returns whether it was written
+    template <unsigned Features>
+    bool shadePixel(Shader& shader, PipelineStats* st, int x, int y, const vec3& bar, uint64_t& fsNs,
+                    uint32_t samples = ~0u)
+    {
+        const glm::ivec2 target{ x, y };
+        return shadePixels<Features>(shader, st, x, y, bar, fsNs, &target, 1, samples);
+    }
+
+    // runs fs for (x, y) and writes its result to the count pixels of targets, false if it discarded
+    template <unsigned Features>
+    bool shadePixels(Shader& shader, PipelineStats* st, int x, int y, const vec3& bar, uint64_t& fsNs,
+                     const glm::ivec2* targets, int count, uint32_t samples)
+    {
+        constexpr bool Stats = Features & DebugStats;
+        constexpr bool Heatmap = Features & DebugHeatmap;
+        [[maybe_unused]] Clock::time_point fsStart;
+        if constexpr (Stats) fsStart = Clock::now();
+
+        // deferred triangles leave the color to resolveDeferred()
+        const bool deferred = _deferred && shader._primType == PrimitiveType::Triangle;
+        vec4 fsColor;
+        Surface surface;
+        bool discard = deferred ? shader.surface(bar, surface) : shader.fs(bar, fsColor);
+        if constexpr (Heatmap) _heatmap[y * _frame->width() + x].shaded++;
+
+        if constexpr (Stats) {
+            fsNs += elapsedNs(fsStart);
+            st->fragmentsShaded++;
+            st->fragmentsDiscarded += discard;
+            st->pixelsWritten += discard ? 0 : count;
+        }
+        if (discard) return false;
+
+        const Color color = toColor(fsColor);
+        for (int i = 0; i < count; i++) {
+            const int tx = targets[i].x, ty = targets[i].y;
+            if constexpr (Features & PassMsaa) {
+                storeSamples(tx, ty, color, samples);
+            }
+            else if (deferred) {
+                _gbuffer.store(ty * _frame->width() + tx, surface);
+            }
+            else {
+                _frame->setPixel(tx, ty, color);
+                if (!_gbuffer.written.empty()) _gbuffer.written[ty * _frame->width() + tx] = 0;
             }
         }
+        return true;
     }
 
-    void clear()
+    static glm::ivec2 rateSize(ShadingRate rate)
     {
-        std::fill(_zbuffer.begin(), _zbuffer.end(), std::numeric_limits<double>::max());
-        _frame->clear();
+        switch (rate) {
+        case ShadingRate::Rate1x2:
+            return { 1, 2 };
+        case ShadingRate::Rate2x2:
+            return { 2, 2 };
+        case ShadingRate::Rate4x4:
+            return { 4, 4 };
+        default:
+            return { 1, 1 };
+        }
     }
 
-private:
-    void drawPoint(int primID, int vert)
+    ShadingRate tileRate(int x, int y) const
+    {
+        const int tilesX = (_frame->width() + TileSize - 1) / TileSize;
+        size_t tile = (y / TileSize) * tilesX + x / TileSize;
+        return tile < _tileRates.size() ? _tileRates[tile] : ShadingRate::Rate1x1;
+    }
+
+    // rasterTriangle with coarse shading. blocks are aligned to the screen, depth is tested per pixel and fs runs
+    // once per block for the pixels that passed, at the block center when the triangle covers it and else at the
+    // first pixel that passed
+    template <unsigned Features>
+    void rasterCoarse(Shader& shader, const DrawSlot& slot, const TriangleSetup& tri, int x0, int x1, int y0, int y1)
+    {
+        constexpr bool Stats = Features & DebugStats;
+        constexpr bool Heatmap = Features & DebugHeatmap;
+
+        PipelineStats* st = nullptr;
+        uint64_t fsNs = 0;
+        [[maybe_unused]] Clock::time_point rasterStart;
+        if constexpr (Stats) {
+            st = &threadStats();
+            rasterStart = Clock::now();
+        }
+
+        const int width = _frame->width();
+        // 4x4 steps cover every rate, the tile rate is looked up once per step
+        for (int qy = y0 & ~3; qy <= y1; qy += 4) {
+            for (int qx = x0 & ~3; qx <= x1; qx += 4) {
+                const glm::ivec2 size = rateSize(std::max(slot.shadingRate, tileRate(qx, qy)));
+                for (int by = qy; by < qy + 4; by += size.y) {
+                    for (int bx = qx; bx < qx + 4; bx += size.x) {
+                        glm::ivec2 targets[16];
+                        double depths[16];
+                        vec3 bar;
+                        int count = 0;
+                        for (int y = std::max(by, y0); y <= std::min(by + size.y - 1, y1); y++) {
+                            for (int x = std::max(bx, x0); x <= std::min(bx + size.x - 1, x1); x++) {
+                                int64_t w[3];
+                                tri.edgesAt(x, y, w);
+                                if (!TriangleSetup::inside(w)) continue;
+                                if constexpr (Stats) st->pixelsCovered++;
+
+                                vec3 bc_screen = tri.barycentric(w);
+
+                                double depth = glm::dot(tri.depth, bc_screen);
+                                if constexpr (Heatmap) _heatmap[y * width + x].depthTests++;
+                                bool failed = Features & PassDepthEqual ? depth != _zbuffer[y * width + x]
+                                                                        : depth > _zbuffer[y * width + x];
+                                if (failed) {
+                                    if constexpr (Stats) st->depthTestsFailed++;
+                                    continue;
+                                }
+                                if constexpr (Stats) st->depthTestsPassed++;
+                                if constexpr (Heatmap) _heatmap[y * width + x].depthPasses++;
+                                if (!count) bar = bc_screen;
+                                targets[count] = { x, y };
+                                depths[count++] = depth;
+                            }
+                        }
+                        if (!count) continue;
+
+                        // steps are multiples of the subpixel grid, halving them stays exact
+                        int64_t center[3];
+                        tri.edgesAt(bx, by, center);
+                        for (int i = 0; i < 3; i++) {
+                            center[i] += (tri.stepX[i] * (size.x - 1) + tri.stepY[i] * (size.y - 1)) / 2;
+                        }
+                        if (TriangleSetup::inside(center)) bar = tri.barycentric(center);
+                        if (!shadePixels<Features>(shader, st, targets[0].x, targets[0].y, bar, fsNs, targets, count,
+                                                   ~0u)) {
+                            continue;
+                        }
+                        if constexpr (!(Features & PassDepthEqual)) {
+                            for (int i = 0; i < count; i++) {
+                                _zbuffer[targets[i].y * width + targets[i].x] = depths[i];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        if constexpr (Stats) {
+            st->fragmentNs += fsNs;
+            st->rasterNs += elapsedNs(rasterStart) - fsNs;
+        }
+    }
+
+    // standard sample positions in 1/16 pixel around the pixel center
+    static const glm::ivec2* sampleOffsets(int count)
+    {
+        static constexpr glm::ivec2 two[] = { { 4, 4 }, { -4, -4 } };
+        static constexpr glm::ivec2 four[] = { { -2, -6 }, { 6, -2 }, { -6, 2 }, { 2, 6 } };
+        static constexpr glm::ivec2 eight[] = { { 1, -3 }, { -1, 3 }, { 5, 1 },   { -3, -5 },
+                                                { -5, 5 }, { -7, -1 }, { 3, 7 }, { 7, -7 } };
+        return count == 2 ? two : count == 4 ? four : eight;
+    }
+
+    // the largest distance of a sample from the pixel center along either axis, in 1/16 pixel
+    static int sampleReach(int count)
+    {
+        const glm::ivec2* offsets = sampleOffsets(count);
+        int reach = 0;
+        for (int i = 0; i < count; i++) reach = std::max({ reach, std::abs(offsets[i].x), std::abs(offsets[i].y) });
+        return reach;
+    }
+
+    // rasterTriangle of the multisampled Shade pass, the edge functions of the samples step from the pixel center's
+    template <unsigned Features>
+    void rasterSamples(Shader& shader, const TriangleSetup& tri, int x0, int x1, int y0, int y1)
+    {
+        constexpr bool Stats = Features & DebugStats;
+        constexpr bool Heatmap = Features & DebugHeatmap;
+
+        PipelineStats* st = nullptr;
+        uint64_t fsNs = 0;
+        [[maybe_unused]] Clock::time_point rasterStart;
+        if constexpr (Stats) {
+            st = &threadStats();
+            rasterStart = Clock::now();
+        }
+
+        const int width = _frame->width(), n = _samples;
+        const glm::ivec2* offsets = sampleOffsets(n);
+        int64_t steps[8][3];
+        for (int i = 0; i < n; i++) {
+            for (int e = 0; e < 3; e++) {
+                steps[i][e] = (tri.stepX[e] * offsets[i].x + tri.stepY[e] * offsets[i].y) / 16;
+            }
+        }
+
+        for (int y = y0; y <= y1; y++) {
+            for (int x = x0; x <= x1; x++) {
+                int64_t center[3];
+                tri.edgesAt(x, y, center);
+                double* stored = &_sampleDepth[((size_t)y * width + x) * n];
+                double depths[8];
+                uint32_t covered = 0, passed = 0;
+                vec3 bar;
+                for (int i = 0; i < n; i++) {
+                    int64_t w[3] = { center[0] + steps[i][0], center[1] + steps[i][1], center[2] + steps[i][2] };
+                    if (!TriangleSetup::inside(w)) continue;
+                    vec3 bc = tri.barycentric(w);
+                    if (!covered) bar = bc;
+                    covered |= 1u << i;
+                    depths[i] = glm::dot(tri.depth, bc);
+                    if (depths[i] <= stored[i]) passed |= 1u << i;
+                }
+                if (!covered) continue;
+                if constexpr (Stats) st->pixelsCovered++;
+                if constexpr (Heatmap) _heatmap[y * width + x].depthTests++;
+                if (!passed) {
+                    if constexpr (Stats) st->depthTestsFailed++;
+                    continue;
+                }
+                if constexpr (Stats) st->depthTestsPassed++;
+                if constexpr (Heatmap) _heatmap[y * width + x].depthPasses++;
+
+                if (TriangleSetup::inside(center)) bar = tri.barycentric(center);
+                if (!shadePixel<Features>(shader, st, x, y, bar, fsNs, passed)) continue;
+                for (int i = 0; i < n; i++) {
+                    if (passed >> i & 1) stored[i] = depths[i];
+                }
+            }
+        }
+
+        if constexpr (Stats) {
+            st->fragmentNs += fsNs;
+            st->rasterNs += elapsedNs(rasterStart) - fsNs;
+        }
+    }
+
+    // pixels of compressed blocks live in the frame alone, a write to only some samples expands the block first
+    void storeSamples(int x, int y, const Color& color, uint32_t samples)
+    {
+        const int width = _frame->width(), n = _samples;
+        const uint32_t all = (1u << n) - 1;
+        const int bx = x / SampleBlock, by = y / SampleBlock;
+        uint8_t& compressed = _sampleBlocks[by * _sampleBlocksX + bx];
+        if (compressed && (samples & all) == all) {
+            _frame->setPixel(x, y, color);
+            return;
+        }
+
+        if (compressed) {
+            compressed = 0;
+            for (int py = by * SampleBlock; py < std::min((by + 1) * SampleBlock, _frame->height()); py++) {
+                for (int px = bx * SampleBlock; px < std::min((bx + 1) * SampleBlock, width); px++) {
+                    std::fill_n(&_sampleColors[((size_t)py * width + px) * n], n, _frame->readPixel(px, py));
+                }
+            }
+        }
+        Color* stored = &_sampleColors[((size_t)y * width + x) * n];
+        for (int i = 0; i < n; i++) {
+            if (samples >> i & 1) stored[i] = color;
+        }
+    }
+
+    static Color toColor(vec4 color)
+    {
+        color = color * 255.0f;
+        return { (uint8_t)color[0], (uint8_t)color[1], (uint8_t)color[2], (uint8_t)color[3] };
+    }
+
+    // gathers the tile's lights into lights, then lights the pixels whose last write was deferred
+    void lightTile(int tile, int tilesX, std::vector<const PointLight*>& lights)
+    {
+        JRENDER_TRACE_SCOPE("light tile");
+        const int width = _frame->width();
+        const int x0 = (tile % tilesX) * TileSize, y0 = (tile / tilesX) * TileSize;
+        const int x1 = std::min(x0 + TileSize, width) - 1, y1 = std::min(y0 + TileSize, _frame->height()) - 1;
+        const auto& [albedo, normal, position, written] = _gbuffer;
+
+        AABB bounds;
+        for (int y = y0; y <= y1; y++) {
+            for (int x = x0; x <= x1; x++) {
+                int i = y * width + x;
+                if (written[i]) bounds.expand({ position[0][i], position[1][i], position[2][i] });
+            }
+        }
+        if (bounds.empty()) return;
+
+        lights.clear();
+        for (const auto& light : _lights) {
+            vec3 nearest = glm::clamp(light.position, bounds.min, bounds.max);
+            if (light.radius <= 0 || glm::length(nearest - light.position) < light.radius) lights.push_back(&light);
+        }
+
+        uint64_t evaluations = 0;
+        for (int y = y0; y <= y1; y++) {
+            for (int x = x0; x <= x1; x++) {
+                int i = y * width + x;
+                if (!written[i]) continue;
+                vec4 color{ albedo[0][i], albedo[1][i], albedo[2][i], albedo[3][i] };
+                vec3 n{ normal[0][i], normal[1][i], normal[2][i] };
+                if (n != vec3(0.f)) {
+                    vec3 p{ position[0][i], position[1][i], position[2][i] };
+                    vec3 light = _ambient;
+                    for (const PointLight* l : lights) {
+                        light += l->lambert(p, n);
+                    }
+                    color = vec4(light * vec3(color), color.a);
+                    evaluations += lights.size();
+                }
+                _frame->setPixel(x, y, toColor(color));
+            }
+        }
+        if (_statsEnabled) threadStats().lightsShaded += evaluations;
+    }
+
+    template <unsigned Features>
+    void drawPoint(int primID, int instanceID, int vert)
     {
+        constexpr bool Stats = Features & DebugStats;
+        [[maybe_unused]] Clock::time_point t0;
+        if constexpr (Stats) t0 = Clock::now();
+
         _shader->_primType = PrimitiveType::Point;
         _shader->_primID = primID;
+        bindInstance(*_shader, _drawInstances, instanceID);
 
         _shader->_vertexID = 0;
         vec4 pV = _viewport * _shader->vs(_model->vertex(vert));
         vec2 pt{ pV[0] / pV[3], pV[1] / pV[3] };
 
-        vec4 fsColor;
-        if (!_shader->fs(vec3{ 1.0, 0.0, 0.0 }, fsColor)) {
-            fsColor = fsColor * 255.0f;
-            jrender::Color color{ (uint8_t)fsColor[0], (uint8_t)fsColor[1], (uint8_t)fsColor[2], (uint8_t)fsColor[3] };
-            _frame->setPixel((int)pt.x, (int)pt.y, color);
+        PipelineStats* st = nullptr;
+        if constexpr (Stats) {
+            st = &threadStats();
+            st->verticesShaded++;
+            st->primitivesSubmitted++;
+            st->vertexNs += elapsedNs(t0);
+        }
+
+        if (pt.x < 0 || pt.y < 0 || pt.x >= _frame->width() || pt.y >= _frame->height()) {
+            if constexpr (Stats) st->primitivesClipped++;
+            return;
         }
+
+        uint64_t fsNs = 0;
+        if constexpr (Stats) st->pixelsCovered++;
+        shadePixel<Features>(*_shader, st, (int)pt.x, (int)pt.y, vec3{ 1.0, 0.0, 0.0 }, fsNs);
+        if constexpr (Stats) st->fragmentNs += fsNs;
     }
 
-    void drawLine(int primID, int vert[2])
+    template <unsigned Features>
+    void drawLine(int primID, int instanceID, int vert[2])
     {
+        constexpr bool Stats = Features & DebugStats;
+        [[maybe_unused]] Clock::time_point t0;
+        if constexpr (Stats) t0 = Clock::now();
+
         _shader->_primType = PrimitiveType::Line;
         _shader->_primID = primID;
+        bindInstance(*_shader, _drawInstances, instanceID);
 
         _shader->_vertexID = 0;
         vec4 pV0 = _viewport * _shader->vs(_model->vertex(vert[0]));
@@ -498,58 +3794,51 @@ private:
             { pV1[0] / pV1[3], pV1[1] / pV1[3] },
         };
 
-#pragma omp parallel for
+        PipelineStats* st = nullptr;
+        [[maybe_unused]] Clock::time_point rasterStart;
+        if constexpr (Stats) {
+            st = &threadStats();
+            st->verticesShaded += 2;
+            st->primitivesSubmitted++;
+            st->vertexNs += elapsedNs(t0);
+            rasterStart = Clock::now();
+        }
+
+        uint64_t fsNs = 0;
         for (const auto& p : linePoints(vec2{ pts[0].x, pts[0].y }, vec2{ pts[1].x, pts[1].y })) {
-            vec4 fsColor;
-            if (!_shader->fs(barycentricLine(pts, p), fsColor)) {
-                fsColor = fsColor * 255.0f;
-                jrender::Color color{ (uint8_t)fsColor[0], (uint8_t)fsColor[1], (uint8_t)fsColor[2],
-                                      (uint8_t)fsColor[3] };
-                _frame->setPixel(p.x, p.y, color);
-            }
+            if (p.x < 0 || p.y < 0 || p.x >= _frame->width() || p.y >= _frame->height()) continue;
+            if constexpr (Stats) st->pixelsCovered++;
+            shadePixel<Features>(*_shader, st, p.x, p.y, barycentricLine(pts, p), fsNs);
+        }
+
+        if constexpr (Stats) {
+            st->fragmentNs += fsNs;
+            st->rasterNs += elapsedNs(rasterStart) - fsNs;
         }
     }
 
-    void drawTriangle(int primID, int vert[3])
+    // immediate path for shaders that can't be copied: vertices are shaded on the calling thread and fs runs on
+    // the shared shader, large triangles split their rows across the pool
+    template <unsigned Features>
+    void drawTriangle(const DrawSlot& slot, int primID, int instanceID, int vert[3])
     {
-        _shader->_primType = PrimitiveType::Triangle;
-        _shader->_primID = primID;
-
-        _shader->_vertexID = 0;
-        vec4 pV0 = _viewport * _shader->vs(_model->vertex(vert[0]));
-
-        _shader->_vertexID = 1;
-        vec4 pV1 = _viewport * _shader->vs(_model->vertex(vert[1]));
-
-        _shader->_vertexID = 2;
-        vec4 pV2 = _viewport * _shader->vs(_model->vertex(vert[2]));
-
-        vec2 pts[3] = { vec2(pV0 / pV0[3]), vec2(pV1 / pV1[3]), vec2(pV2 / pV2[3]) };
-
-        int minX = std::min({ pts[0].x, pts[1].x, pts[2].x });
-        int maxX = std::max({ pts[0].x, pts[1].x, pts[2].x });
-        int minY = std::min({ pts[0].y, pts[1].y, pts[2].y });
-        int maxY = std::max({ pts[0].y, pts[1].y, pts[2].y });
-
-#pragma omp parallel for
-        for (int x = std::max(minX, 0); x <= std::min(maxX, _frame->width() - 1); x++) {
-            for (int y = std::max(minY, 0); y <= std::min(maxY, _frame->height() - 1); y++) {
-                vec3 bc_screen = barycentric(pts, vec2{ (double)x, (double)y });
-                double depth = glm::dot(vec3(pV0.z, pV1.z, pV2.z), bc_screen);
-                if (bc_screen.x < 0 || bc_screen.y < 0 || bc_screen.z < 0
-                    || depth > _zbuffer[y * _frame->width() + x]) {
-                    continue;
-                }
-
-                vec4 fsColor;
-                if (!_shader->fs(bc_screen, fsColor)) {
-                    _zbuffer[y * _frame->width() + x] = depth;
-                    fsColor = fsColor * 255.0f;
-                    Color color{ (uint8_t)fsColor[0], (uint8_t)fsColor[1], (uint8_t)fsColor[2], (uint8_t)fsColor[3] };
-                    _frame->setPixel(x, y, color);
-                }
-            }
+        TriangleSetup tri;
+        if (!setupTriangle<Features>(*_shader, slot, primID, instanceID, vert, tri)) return;
+
+        int grain = std::max(1, ParallelPixels / (tri.maxX - tri.minX + 1));
+        if constexpr (Features & PassMsaa) {
+            // rows of sample blocks, so no two chunks decompress the same block
+            auto blockRows = [&](int b0, int b1) {
+                rasterTriangle<Features>(*_shader, slot, tri, tri.minX, tri.maxX, std::max(b0 * SampleBlock, tri.minY),
+                                         std::min(b1 * SampleBlock, tri.maxY + 1) - 1);
+            };
+            ThreadPool::global().parallelFor(tri.minY / SampleBlock, tri.maxY / SampleBlock + 1,
+                                             std::max(1, grain / SampleBlock), blockRows);
+            return;
         }
+        ThreadPool::global().parallelFor(tri.minY, tri.maxY + 1, grain, [&](int y0, int y1) {
+            rasterTriangle<Features>(*_shader, slot, tri, tri.minX, tri.maxX, y0, y1 - 1);
+        });
     }
 
 private:
@@ -558,7 +3847,62 @@ private:
     ShaderPtr _shader;
     glm::mat4 _viewport;
 
+    InstanceBuffer _instances;
+    InstanceBuffer _drawInstances;  // _instances while an instanced draw runs, empty otherwise
+    std::vector<DrawRun> _runs;          // what the current draw kept after culling
+    std::vector<uint8_t> _faceVisible;  // per face of the draw, set by cullMeshlets()
+    glm::mat4 _viewProj{ 1.f };
+    bool _cullEnabled{ false };
+    bool _frontToBack{ false };
+    float _resortCos{ 0.f };
+    std::vector<int> _instanceOrder;
+    std::vector<float> _instanceDepths;
+    std::vector<ClusterOrder> _clusterOrders;  // one per live model drawn front to back
+    std::shared_ptr<const OcclusionBuffer> _occlusion;
+
     std::vector<double> _zbuffer;
+
+    std::array<DrawSlot, 2> _slots;
+    int _slot{ 0 };
+
+    bool _pipelined{ false };
+    std::mutex _backEndMutex;
+    std::deque<std::packaged_task<void()>> _backEndQueue;
+    bool _backEndRunning{ false };
+    std::condition_variable _backEndIdle;
+    std::shared_future<void> _backEndDone;  // last queued back end step
+
+    bool _incremental{ false };
+    bool _fullDamage{ true };
+    std::vector<RetainedDraw> _retained;    // since the last clear()
+    std::vector<DrawDamage> _previousDraws;  // of the last endFrame()
+    std::vector<std::unique_ptr<DrawSlot>> _slotPool;
+    std::vector<Rect> _invalidated;
+    std::vector<uint8_t> _damagedTiles;
+
+    bool _statsEnabled{ false };
+    std::vector<ThreadStats> _threadStats;
+
+    bool _heatmapEnabled{ false };
+    std::vector<HeatmapTexel> _heatmap;
+
+    DepthPass _depthPass{ DepthPass::Shade };
+    std::vector<uint64_t> _visibility;
+    std::vector<VisibilityDraw> _visibilityDraws;  // since the last clear()
+
+    bool _deferred{ false };
+    GBuffer _gbuffer;
+    std::vector<PointLight> _lights;
+    vec3 _ambient{ 0.f };
+
+    ShadingRate _shadingRate{ ShadingRate::Rate1x1 };
+    std::vector<ShadingRate> _tileRates;
+
+    int _samples{ 1 };
+    std::vector<double> _sampleDepth;    // samples of a pixel next to each other
+    std::vector<Color> _sampleColors;    // only meaningful in blocks that aren't compressed
+    std::vector<uint8_t> _sampleBlocks;  // per block, whether its color is only in the frame
+    int _sampleBlocksX{ 0 };
 };
 
-}  // namespace jrender
\ No newline at end of file
+}  // namespace jrender
@@ -0,0 +1,298 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace jrender {
+
+// persistent workers with one deque each. a worker pops its own newest task and steals the oldest task of
+// another queue when it runs dry, threads outside the pool push to an extra shared queue. threads waiting on
+// work (parallelFor, wait) execute queued tasks while there are any and block once they run dry for a while
+class ThreadPool
+{
+public:
+    struct Config
+    {
+        unsigned threads{ 0 };  // 0 picks one less than the hardware threads, the caller of parallelFor helps
+        std::vector<int> cpus;  // pins worker i to cpus[i % cpus.size()] when not empty
+    };
+
+    ThreadPool() : ThreadPool(Config{}) {}
+
+    explicit ThreadPool(const Config& config)
+    {
+        unsigned threadCount = config.threads;
+        if (!threadCount) threadCount = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+        for (unsigned i = 0; i <= threadCount; i++) {
+            _queues.push_back(std::make_unique<WorkQueue>());
+        }
+        _workers.reserve(threadCount);
+        for (unsigned i = 0; i < threadCount; i++) {
+            _workers.emplace_back([this, i] { workerLoop(i); });
+            if (!config.cpus.empty()) pin(_workers.back(), config.cpus[i % config.cpus.size()]);
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_sleepMutex);
+            _stop = true;
+        }
+        _sleepCv.notify_all();
+        for (auto& t : _workers) {
+            t.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    unsigned threadCount() const { return _workers.size(); }
+
+    // index of the calling worker, threadCount() for every thread outside the pool
+    unsigned workerIndex() const { return tlsPool == this ? tlsIndex : threadCount(); }
+
+    template <class F>
+    std::future<std::invoke_result_t<F>> submit(F&& func)
+    {
+        using Result = std::invoke_result_t<F>;
+        auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(func));
+        std::future<Result> ret = task->get_future();
+        push([task] { (*task)(); });
+        return ret;
+    }
+
+    // calls func(chunkBegin, chunkEnd) over [begin, end) in chunks of grain, the calling thread takes part and
+    // returns once every chunk has run. the first exception a chunk throws is rethrown there
+    template <class F>
+    void parallelFor(int begin, int end, int grain, F&& func)
+    {
+        if (end <= begin) return;
+        grain = std::max(grain, 1);
+        int chunks = (end - begin + grain - 1) / grain;
+        if (chunks == 1) {
+            func(begin, end);
+            return;
+        }
+
+        struct Shared
+        {
+            F& func;
+            std::atomic<int> remaining;
+            std::mutex errorMutex;
+            std::exception_ptr error;
+
+            void run(int b, int e)
+            {
+                try {
+                    func(b, e);
+                }
+                catch (...) {
+                    std::lock_guard<std::mutex> lock(errorMutex);
+                    if (!error) error = std::current_exception();
+                }
+                remaining.fetch_sub(1, std::memory_order_release);
+            }
+        } shared{ func, chunks, {}, {} };
+        for (int c = chunks - 1; c > 0; c--) {
+            int b = begin + c * grain;
+            push([s = &shared, b, e = std::min(end, b + grain)] { s->run(b, e); });
+        }
+        shared.run(begin, begin + grain);
+        auto done = [&shared] { return shared.remaining.load(std::memory_order_acquire) == 0; };
+        waitUntil(done, [&] { sleepUntil(done); });
+        if (shared.error) std::rethrow_exception(shared.error);
+    }
+
+    // futures may be completed outside of pool tasks, so once idle the caller blocks on the future itself and
+    // only looks for new tasks every WaitSlice
+    template <class T>
+    void wait(const std::shared_future<T>& future)
+    {
+        constexpr auto WaitSlice = std::chrono::milliseconds(1);
+        waitUntil([&future] { return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready; },
+                  [&] { future.wait_for(WaitSlice); });
+    }
+
+    // JRENDER_THREADS and JRENDER_CPUS (comma separated) override the defaults, configure() replaces them. both
+    // only take effect before the first call to global()
+    static void configure(Config config) { globalConfig() = std::move(config); }
+
+    static ThreadPool& global()
+    {
+        static ThreadPool pool(globalConfig());
+        return pool;
+    }
+
+private:
+    using Task = std::function<void()>;
+
+    struct alignas(64) WorkQueue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    static Config& globalConfig()
+    {
+        static Config config = [] {
+            Config ret;
+            if (const char* threads = std::getenv("JRENDER_THREADS")) ret.threads = std::max(0, std::atoi(threads));
+            if (const char* cpus = std::getenv("JRENDER_CPUS")) {
+                std::stringstream ss(cpus);
+                std::string item;
+                while (std::getline(ss, item, ',')) {
+                    ret.cpus.push_back(std::atoi(item.c_str()));
+                }
+            }
+            return ret;
+        }();
+        return config;
+    }
+
+    static void pin([[maybe_unused]] std::thread& thread, [[maybe_unused]] int cpu)
+    {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#endif
+    }
+
+    void push(Task task)
+    {
+        WorkQueue& q = *_queues[workerIndex()];
+        {
+            std::lock_guard<std::mutex> lock(q.mutex);
+            q.tasks.push_back(std::move(task));
+        }
+        _pending.fetch_add(1, std::memory_order_release);
+        {
+            std::lock_guard<std::mutex> lock(_sleepMutex);
+        }
+        _sleepCv.notify_one();
+        wakeWaiters();
+    }
+
+    // callers blocked in sleepUntil recheck their condition and the queues
+    void wakeWaiters()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!_waiters.load(std::memory_order_relaxed)) return;
+        {
+            std::lock_guard<std::mutex> lock(_sleepMutex);
+        }
+        _waitCv.notify_all();
+    }
+
+    // own queue newest first, then the oldest task of the others
+    bool runOne(unsigned index)
+    {
+        Task task;
+        {
+            WorkQueue& q = *_queues[index];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.tasks.empty()) {
+                task = std::move(q.tasks.back());
+                q.tasks.pop_back();
+            }
+        }
+        for (size_t i = 1; !task && i < _queues.size(); i++) {
+            WorkQueue& q = *_queues[(index + i) % _queues.size()];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.tasks.empty()) {
+                task = std::move(q.tasks.front());
+                q.tasks.pop_front();
+            }
+        }
+        if (!task) return false;
+
+        _pending.fetch_sub(1, std::memory_order_relaxed);
+        task();
+        wakeWaiters();
+        return true;
+    }
+
+    // runs queued tasks until done() holds. after SpinRounds tries that found no task it calls sleep(), so a
+    // thread waiting on one long task leaves its core to the worker running it
+    template <class Pred, class Sleep>
+    void waitUntil(Pred done, Sleep sleep)
+    {
+        constexpr int SpinRounds = 64;
+        unsigned index = workerIndex();
+        int idle = 0;
+        while (!done()) {
+            if (runOne(index)) {
+                idle = 0;
+            }
+            else if (++idle < SpinRounds) {
+                std::this_thread::yield();
+            }
+            else {
+                sleep();
+                idle = 0;
+            }
+        }
+    }
+
+    // for conditions that only pool tasks change, wakes once a task finishes or gets queued
+    template <class Pred>
+    void sleepUntil(Pred done)
+    {
+        _waiters.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        {
+            std::unique_lock<std::mutex> lock(_sleepMutex);
+            _waitCv.wait(lock, [&] { return done() || _pending.load(std::memory_order_acquire) > 0; });
+        }
+        _waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void workerLoop(unsigned index)
+    {
+        tlsPool = this;
+        tlsIndex = index;
+        while (true) {
+            if (runOne(index)) continue;
+
+            std::unique_lock<std::mutex> lock(_sleepMutex);
+            if (_stop && _pending.load(std::memory_order_acquire) == 0) return;
+            _sleepCv.wait(lock, [this] { return _stop || _pending.load(std::memory_order_acquire) > 0; });
+        }
+    }
+
+    static inline thread_local const ThreadPool* tlsPool = nullptr;
+    static inline thread_local unsigned tlsIndex = 0;
+
+    std::vector<std::unique_ptr<WorkQueue>> _queues;  // one per worker, the last one is shared by outside threads
+    std::vector<std::thread> _workers;
+    std::atomic<int> _pending{ 0 };
+
+    std::mutex _sleepMutex;
+    std::condition_variable _sleepCv;
+    std::condition_variable _waitCv;  // sleepUntil callers
+    std::atomic<int> _waiters{ 0 };
+    bool _stop{ false };
+};
+
+}  // namespace jrender
@@ -0,0 +1,180 @@
+#pragma once
+
+// scoped timers exported as chrome trace json (chrome://tracing, ui.perfetto.dev). everything below the macros
+// only exists when JRENDER_TRACE is defined, otherwise the macros expand to nothing
+
+#define JRENDER_TRACE_CONCAT_(a, b) a##b
+#define JRENDER_TRACE_CONCAT(a, b) JRENDER_TRACE_CONCAT_(a, b)
+
+#ifdef JRENDER_TRACE
+#define JRENDER_TRACE_SCOPE(name) ::jrender::TraceScope JRENDER_TRACE_CONCAT(_traceScope, __LINE__)(name)
+#define JRENDER_TRACE_DUMP(path) ::jrender::Tracer::instance().dump(path)
+#else
+#define JRENDER_TRACE_SCOPE(name) ((void)0)
+#define JRENDER_TRACE_DUMP(path) ((void)0)
+#endif
+
+#ifdef JRENDER_TRACE
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifndef JRENDER_TRACE_CAPACITY
+#define JRENDER_TRACE_CAPACITY (1 << 16)  // events kept per thread, older ones are overwritten
+#endif
+
+namespace jrender {
+
+// single producer ring, only its own thread writes while dump() may read it concurrently
+class TraceBuffer
+{
+public:
+    explicit TraceBuffer(int tid) : _tid(tid) {}
+
+    void push(const char* name, uint64_t start, uint64_t duration)
+    {
+        uint64_t head = _head.load(std::memory_order_relaxed);
+        Event& e = _events[head % JRENDER_TRACE_CAPACITY];
+        e.name.store(name, std::memory_order_relaxed);
+        e.start.store(start, std::memory_order_relaxed);
+        e.duration.store(duration, std::memory_order_relaxed);
+        _head.store(head + 1, std::memory_order_release);
+    }
+
+    template <class F>
+    void forEach(F&& func) const
+    {
+        uint64_t head = _head.load(std::memory_order_acquire);
+        uint64_t begin = head > JRENDER_TRACE_CAPACITY ? head - JRENDER_TRACE_CAPACITY : 0;
+        struct Copy
+        {
+            const char* name;
+            uint64_t start, duration;
+        };
+        std::vector<Copy> events;
+        events.reserve(head - begin);
+        for (uint64_t i = begin; i < head; i++) {
+            const Event& e = _events[i % JRENDER_TRACE_CAPACITY];
+            events.push_back({ e.name.load(std::memory_order_relaxed), e.start.load(std::memory_order_relaxed),
+                               e.duration.load(std::memory_order_relaxed) });
+        }
+
+        // slots the writer lapped while they were copied may be torn, skip them. once the ring is full the oldest
+        // slot is also the one the next write goes to, which may already be in progress without having bumped _head
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t skip = _head.load(std::memory_order_relaxed) - head + (head >= JRENDER_TRACE_CAPACITY ? 1 : 0);
+        for (size_t i = std::min<uint64_t>(skip, events.size()); i < events.size(); i++) {
+            func(events[i].name, events[i].start, events[i].duration);
+        }
+    }
+
+    int tid() const { return _tid; }
+
+private:
+    struct Event
+    {
+        std::atomic<const char*> name{ nullptr };
+        std::atomic<uint64_t> start{ 0 };
+        std::atomic<uint64_t> duration{ 0 };
+    };
+
+    int _tid;
+    std::atomic<uint64_t> _head{ 0 };
+    Event _events[JRENDER_TRACE_CAPACITY];
+};
+
+class Tracer
+{
+public:
+    // when JRENDER_TRACE_FILE is set the trace is written there at exit
+    static Tracer& instance()
+    {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    ~Tracer()
+    {
+        if (const char* path = std::getenv("JRENDER_TRACE_FILE")) dump(path);
+    }
+
+    uint64_t now() const
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _epoch).count();
+    }
+
+    TraceBuffer& threadBuffer()
+    {
+        thread_local std::shared_ptr<TraceBuffer> buffer = registerThread();
+        return *buffer;
+    }
+
+    // names must be string literals or otherwise outlive the tracer
+    bool dump(const std::string& path)
+    {
+        std::vector<std::shared_ptr<TraceBuffer>> buffers;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            buffers = _buffers;
+        }
+
+        std::ofstream out(path);
+        if (!out) return false;
+        out << std::fixed << std::setprecision(3) << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+        bool first = true;
+        for (const auto& b : buffers) {
+            b->forEach([&](const char* name, uint64_t start, uint64_t duration) {
+                out << (first ? "\n" : ",\n") << "{\"name\":\"" << name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+                    << b->tid() << ",\"ts\":" << start / 1000.0 << ",\"dur\":" << duration / 1000.0 << "}";
+                first = false;
+            });
+        }
+        out << "\n]}\n";
+        return true;
+    }
+
+private:
+    Tracer() : _epoch(std::chrono::steady_clock::now()) {}
+
+    std::shared_ptr<TraceBuffer> registerThread()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _buffers.push_back(std::make_shared<TraceBuffer>(_buffers.size()));
+        return _buffers.back();
+    }
+
+    std::chrono::steady_clock::time_point _epoch;
+    std::mutex _mutex;
+    std::vector<std::shared_ptr<TraceBuffer>> _buffers;  // kept after their thread exits
+};
+
+class TraceScope
+{
+public:
+    explicit TraceScope(const char* name) : _name(name), _start(Tracer::instance().now()) {}
+    ~TraceScope()
+    {
+        Tracer& tracer = Tracer::instance();
+        tracer.threadBuffer().push(_name, _start, tracer.now() - _start);
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    const char* _name;
+    uint64_t _start;
+};
+
+}  // namespace jrender
+
+#endif  // JRENDER_TRACE